@@ -10,49 +10,20 @@
 --
 ---------------------------------------------------------------------------
 --
--- Reads a CSV file, one record per line. Table column names must be a
--- subset of CSV headers on the first line.
+-- Reads a CSV file with fdw.csv. Table columns are matched to CSV headers
+-- on the first line by name; other headers are ignored.
+--
+-- Empty fields are empty strings, never NULL. Set csv_options.null to a
+-- string to read matching unquoted fields as NULL instead, eg null = "" as
+-- in COPY's CSV format, where "" stays an empty string.
 --
 -- CREATE FOREIGN TABLE a_table SERVER lua_fdw OPTIONS (
 --   script '/path/to/csv.lua'
 --   inject 'path = [[/path/to/file.csv]]'
 -- );
-
--- From: http://lua-users.org/wiki/CsvUtils
--- Convert from CSV string to table (converts a single line of a CSV file)
-function fromCSV (s)
-  s = s .. ','        -- ending comma
-  local t = {}        -- table to collect fields
-  local fieldstart = 1
-  repeat
-    -- next field is quoted? (start with `"'?)
-    if string.find(s, '^"', fieldstart) then
-      local a, c
-      local i  = fieldstart
-      repeat
-        -- find closing quote
-        a, i, c = string.find(s, '"("?)', i+1)
-      until c ~= '"'    -- quote not followed by quote?
-      if not i then error('unmatched "') end
-      local f = string.sub(s, fieldstart+1, i-1)
-      table.insert(t, (string.gsub(f, '""', '"')))
-      fieldstart = string.find(s, ',', i) + 1
-    else                -- unquoted; find next comma
-      local nexti = string.find(s, ',', fieldstart)
-      table.insert(t, string.sub(s, fieldstart, nexti-1))
-      fieldstart = nexti + 1
-    end
-  until fieldstart > string.len(s)
-  return t
-end
-
-function getCSV (csv, headers, field)
-  for i = 1,#headers do
-    if field == headers[i] then
-      return csv[i]
-    end
-  end
-end
+--
+-- Set csv_options in inject for other formats, eg
+--   inject 'path = [[/path/to/file.tsv]] csv_options = { delimiter = "\t" }'
 
 function EstimateRowCount ()
   return 0
@@ -71,32 +42,28 @@ function EstimateTotalCost ()
 end
 
 function ScanStart ()
-  file, msg = io.open(path)
+  local options = { null = false }
+  local msg
 
-  if file == nil then
-    fdw.ereport(fdw.ERROR, msg)
+  for k, v in pairs(csv_options or {}) do
+    options[k] = v
   end
 
-  headers = fromCSV(file:read())
-end
+  reader, msg = fdw.csv.open(path, options)
 
-function ScanIterate ()
-  local row = nil
-  local line = file:read()
-  if type(line) == "string" then
-    row = { }
-    local csv = fromCSV(line)
-    for field, data_type in ipairs(fdw.columns) do
-      row[field] = getCSV(csv, headers, field)
-    end
+  if reader == nil then
+    fdw.ereport(fdw.ERROR, msg)
   end
-  return row
+end
+
+function ScanIterateBatch (n)
+  return reader:read_batch(n)
 end
 
 function ScanRestart ()
-  file:seek("set", 0)
+  reader:rewind()
 end
 
 function ScanEnd ()
-  file:close()
+  reader:close()
 end
@@ -48,6 +48,41 @@ scroll = "1m"
 -- Batch size
 batch = 1000
 
+-- Translate an fdw.quals tree of AND, OR and column = constant into an
+-- Elasticsearch bool query, or nil if any part of it can't be. NOT is left
+-- alone: match queries may return extra rows, which must_not would turn
+-- into missing ones.
+function translate (node)
+  if node.kind == "operator" and node.operator == "=" then
+    local column, constant = node.args[1], node.args[2]
+    if column.kind == "constant" then
+      column, constant = constant, column
+    end
+    if column.kind == "column" and constant.kind == "constant" and not column.type:match("timestamp") then
+      return { match = { [remap[column.name] or column.name] = constant.value }}
+    end
+    return nil
+  end
+
+  if node.kind ~= "and" and node.kind ~= "or" then
+    return nil
+  end
+
+  local queries = { }
+  for i, arg in ipairs(node.args) do
+    local query = translate(arg)
+    if not query then
+      return nil
+    end
+    table.insert(queries, query)
+  end
+
+  if node.kind == "and" then
+    return { bool = { must = queries }}
+  end
+  return { bool = { should = queries, minimum_should_match = 1 }}
+end
+
 function ScanStart (is_explain)
 
   client = elasticsearch.client({
@@ -57,7 +92,7 @@ function ScanStart (is_explain)
   filters = { }
 
   -- lua_fdw exposes simple top-level WHERE clauses of the form:
-  -- "column" (eq/ne/lt/gt/lte/gte/like) "constant". Try to
+  -- "column" (eq/ne/lt/gt/lte/gte/like/in/...) constant. Try to
   -- convert them to Elasticsearch query filters. False-positive
   -- results are fine (opposite situation is not!)
 
@@ -80,7 +115,7 @@ function ScanStart (is_explain)
       end
     end
 
-    if fdw.columns[clause.column]:match("timestamp") then
+    if fdw.columns[clause.column]:match("timestamp") and type(value) == "string" then
       value = clause.constant:gsub(" ", "T")
     end
 
@@ -100,6 +135,29 @@ function ScanStart (is_explain)
     if clause.operator == "gte" then
       table.insert(filters, { range = { [field] = { gte = value }}})
     end
+    if clause.operator == "in" then
+      table.insert(filters, { terms = { [field] = value }})
+    end
+    if clause.operator == "is_not_null" then
+      table.insert(filters, { exists = { field = field }})
+    end
+  end
+
+  -- OR conditions only appear in fdw.quals, eg response = 500 OR
+  -- response = 503
+  for i, qual in ipairs(fdw.quals) do
+    if qual.kind == "or" then
+      local query = translate(qual)
+      if query then
+        table.insert(filters, query)
+      end
+    end
+  end
+
+  -- Only fetch fields the query references
+  source = { }
+  for column in pairs(fdw.target) do
+    table.insert(source, remap[column] or column)
   end
 
   data = nil
@@ -123,6 +181,7 @@ function ScanIterate ()
       scroll = scroll,
       body = {
         size = batch,
+        _source = source,
         query = {
           bool = {
             filter = filters,
@@ -155,7 +214,7 @@ function ScanIterate ()
     if #data > 0 then
       local cell = table.remove(data, #data)
       local row = { }
-      for column, data_type in pairs(fdw.columns) do
+      for column in pairs(fdw.target) do
         local field = remap[column] or column
         row[column] = cell["_source"][field]
       end
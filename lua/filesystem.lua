@@ -93,7 +93,9 @@ function ScanIterate ()
 
   if attr then
 
-    for column,data_type in pairs(fdw.columns) do
+    -- Only columns the query references. Reading "content" is
+    -- skipped entirely unless it's selected or filtered on.
+    for column in pairs(fdw.target) do
 
       if column == "path" then
         row.path = path
@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ *                foreign-data wrapper  lua
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author:  Andrew Dunstan <andrew@dunslane.net>
+ *
+ * IDENTIFICATION
+ *                lua_fdw/=sql/lua_fdw--0.0.1--0.0.2.sql
+ *
+ *-------------------------------------------------------------------------
+ */
+
+\echo Use "ALTER EXTENSION lua_fdw UPDATE TO '0.0.2'" to load this file. \quit
+
+CREATE FUNCTION lua_fdw_pool_stats(
+  OUT idle integer,
+  OUT in_use integer,
+  OUT hits bigint,
+  OUT misses bigint,
+  OUT evictions bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
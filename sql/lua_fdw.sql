@@ -27,3 +27,14 @@ LANGUAGE C STRICT;
 CREATE FOREIGN DATA WRAPPER lua_fdw
   HANDLER lua_fdw_handler
   VALIDATOR lua_fdw_validator;
+
+CREATE FUNCTION lua_fdw_pool_stats(
+  OUT idle integer,
+  OUT in_use integer,
+  OUT hits bigint,
+  OUT misses bigint,
+  OUT evictions bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
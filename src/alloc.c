@@ -0,0 +1,298 @@
+/*-------------------------------------------------------------------------
+ *
+ * Lua Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2016 Sean Pringle (lua_fdw)
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Andrew Dunstan <andrew@dunslane.net> (blackhole_fdw)
+ * Author: Sean Pringle <sean.pringle@gmail.com> (lua_fdw)
+ *
+ *-------------------------------------------------------------------------
+ *
+ * Lua allocator backed by a MemoryContext.
+ *
+ * Each Lua state gets its own context under TopMemoryContext, so its memory
+ * shows up in MemoryContextStats and pg_backend_memory_contexts, and is all
+ * freed by deleting the context when the state is closed. The allocator
+ * must never throw: Lua expects NULL on failure and raises its own "not
+ * enough memory" error, which reaches the user through the usual lua_fdw
+ * error path.
+ *
+ * That error can only be caught inside a protected call, so
+ * lua_fdw.memory_limit only applies while script code runs. C code pushing
+ * rows, clauses or globals onto the stack is never refused, and anything
+ * else failing outside a protected call raises an ERROR from the panic
+ * handler instead of letting Lua abort() the backend.
+ */
+
+#include "postgres.h"
+
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#include "lua_fdw.h"
+
+typedef struct
+{
+	MemoryContext context;
+	Size used;
+	int limited;	/* protected calls running under the limit */
+	bool failed;	/* an allocation was refused */
+	bool panicked;	/* an error escaped, the state can't be reused */
+} LuaFdwAlloc;
+
+int lua_fdw_memory_limit = 0;
+int lua_fdw_gc_mode = 0;
+
+static const struct config_enum_entry gc_mode_options[] = {
+	{"incremental", 0, false},
+	{"generational", 1, false},
+	{NULL, 0, false}
+};
+
+void
+lua_alloc_init (void)
+{
+	DefineCustomIntVariable(
+		"lua_fdw.memory_limit",
+		"Largest amount of memory each Lua state may use.",
+		"Allocations beyond this fail with a Lua \"not enough memory\" error. Zero means no limit.",
+		&lua_fdw_memory_limit,
+		0,
+		0,
+		MAX_KILOBYTES,
+		PGC_USERSET,
+		GUC_UNIT_KB,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomEnumVariable(
+		"lua_fdw.gc_mode",
+		"Garbage collector mode for new Lua states.",
+		"generational needs Lua 5.4, and is ignored by older versions.",
+		&lua_fdw_gc_mode,
+		0,
+		gc_mode_options,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+}
+
+static void*
+context_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	LuaFdwAlloc *alloc = (LuaFdwAlloc *) ud;
+	void *block;
+
+	/* osize is a type tag, not a size, when ptr is NULL */
+	if (ptr == NULL)
+		osize = 0;
+
+	if (nsize == 0)
+	{
+		if (ptr)
+			pfree(ptr);
+
+		alloc->used -= osize;
+		return NULL;
+	}
+
+	/* shrinking must not fail, and the block is big enough already */
+	if (ptr && nsize <= osize)
+	{
+		alloc->used -= osize - nsize;
+		return ptr;
+	}
+
+	if (alloc->limited > 0 && lua_fdw_memory_limit > 0
+		&& alloc->used + (nsize - osize) > (Size) lua_fdw_memory_limit * 1024)
+		return NULL;
+
+#if PG_VERSION_NUM >= 90500
+	block = MemoryContextAllocExtended(alloc->context, nsize, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+#else
+	block = MemoryContextAllocHuge(alloc->context, nsize);
+#endif
+
+	if (block == NULL)
+	{
+		alloc->failed = true;
+		return NULL;
+	}
+
+	if (ptr)
+	{
+		memcpy(block, ptr, osize);
+		pfree(ptr);
+	}
+
+	alloc->used += nsize - osize;
+	return block;
+}
+
+static LuaFdwAlloc*
+context_of (lua_State *lua)
+{
+	void *ud;
+
+	if (lua_getallocf(lua, &ud) != context_alloc)
+		return NULL;
+
+	return (LuaFdwAlloc *) ud;
+}
+
+/*
+ * Lua calls this for an error outside any protected call, and aborts the
+ * process if it returns. Raise an ERROR instead. The state is in no fit
+ * condition to run again, so it is closed once released, or when the
+ * transaction aborts.
+ */
+static int
+context_panic (lua_State *lua)
+{
+	LuaFdwAlloc *alloc = context_of(lua);
+	const char *message = lua_tostring(lua, -1);
+
+	if (alloc)
+		alloc->panicked = true;
+
+	ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", message ? message : "unprotected error")));
+	return 0;
+}
+
+/*
+ * Start an empty Lua state allocating from its own MemoryContext. LuaJIT
+ * on 64-bit platforms refuses custom allocators without trying them, in
+ * which case the state falls back to malloc.
+ */
+lua_State*
+lua_newstate_context (void)
+{
+	LuaFdwAlloc *alloc;
+	lua_State *lua;
+
+	alloc = MemoryContextAllocZero(TopMemoryContext, sizeof(LuaFdwAlloc));
+
+#if PG_VERSION_NUM >= 90600
+	alloc->context = AllocSetContextCreate(TopMemoryContext, "lua_fdw state", ALLOCSET_DEFAULT_SIZES);
+#else
+	alloc->context = AllocSetContextCreate(TopMemoryContext, "lua_fdw state",
+		ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+
+	lua = lua_newstate(context_alloc, alloc);
+
+	if (lua == NULL)
+	{
+		bool failed = alloc->failed;
+
+		MemoryContextDelete(alloc->context);
+		pfree(alloc);
+
+		if (failed)
+			ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory"),
+				errdetail("Failed while starting a Lua state.")));
+
+		lua = luaL_newstate();
+
+		if (lua == NULL)
+			ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory"),
+				errdetail("Failed while starting a Lua state.")));
+	}
+
+	lua_atpanic(lua, context_panic);
+
+#if LUA_VERSION_NUM >= 504
+	if (lua_fdw_gc_mode == 1)
+		lua_gc(lua, LUA_GCGEN, 0, 0);
+#endif
+
+	return lua;
+}
+
+/*
+ * Enforce lua_fdw.memory_limit on a state until the matching
+ * lua_limit_end(), eg around resuming a coroutine. Calls may nest.
+ */
+void
+lua_limit_begin (lua_State *lua)
+{
+	LuaFdwAlloc *alloc = context_of(lua);
+
+	if (alloc)
+		alloc->limited++;
+}
+
+void
+lua_limit_end (lua_State *lua)
+{
+	LuaFdwAlloc *alloc = context_of(lua);
+
+	if (alloc && alloc->limited > 0)
+		alloc->limited--;
+}
+
+/*
+ * lua_pcall, with script code held to lua_fdw.memory_limit.
+ */
+int
+lua_pcall_limited (lua_State *lua, int args, int results)
+{
+	int status;
+
+	lua_limit_begin(lua);
+	status = lua_pcall(lua, args, results, 0);
+	lua_limit_end(lua);
+
+	return status;
+}
+
+/*
+ * Whether an error escaped a protected call on this state.
+ */
+bool
+lua_panicked (lua_State *lua)
+{
+	LuaFdwAlloc *alloc = context_of(lua);
+
+	return alloc && alloc->panicked;
+}
+
+/*
+ * Close a state, freeing everything it allocated at once.
+ */
+void
+lua_close_context (lua_State *lua)
+{
+	LuaFdwAlloc *alloc = context_of(lua);
+
+	lua_close(lua);
+
+	if (alloc)
+	{
+		MemoryContextDelete(alloc->context);
+		pfree(alloc);
+	}
+}
+
+/*
+ * Bytes in use by a state, as Lua counts them. Falls back to Lua's own
+ * count for malloc states.
+ */
+Size
+lua_memory_used (lua_State *lua)
+{
+	LuaFdwAlloc *alloc = context_of(lua);
+
+	if (alloc)
+		return alloc->used;
+
+	return (Size) lua_gc(lua, LUA_GCCOUNT, 0) * 1024 + lua_gc(lua, LUA_GCCOUNTB, 0);
+}
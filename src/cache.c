@@ -0,0 +1,361 @@
+/*-------------------------------------------------------------------------
+ *
+ * Lua Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2016 Sean Pringle (lua_fdw)
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Andrew Dunstan <andrew@dunslane.net> (blackhole_fdw)
+ * Author: Sean Pringle <sean.pringle@gmail.com> (lua_fdw)
+ *
+ *-------------------------------------------------------------------------
+ *
+ * Shared memory cache of compiled Lua chunks.
+ *
+ * Scripts and inject strings are compiled once, saved with lua_dump, and
+ * loaded as bytecode by every other backend. Script entries are keyed by
+ * path, mtime and size. Inject entries store the source text ahead of the
+ * bytecode and compare it byte for byte, so hash collisions are harmless.
+ *
+ * Only available when lua_fdw is in shared_preload_libraries. Otherwise
+ * chunks are compiled from source as before.
+ */
+
+#include <sys/stat.h>
+
+#include "postgres.h"
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+
+#include "lua_fdw.h"
+
+typedef struct
+{
+	bool valid;
+	char path[MAXPGPATH];	/* empty for inject chunks */
+	time_t mtime;
+	int64 size;
+	uint32 hash;			/* hash of inject text */
+	Size text_length;		/* inject text stored ahead of bytecode */
+	Size length;			/* bytecode */
+} LuaFdwChunk;
+
+typedef struct
+{
+	LWLock *lock;
+	uint32 clock;
+	LuaFdwChunk chunks[FLEXIBLE_ARRAY_MEMBER];
+} LuaFdwCache;
+
+int lua_fdw_cache_slots = 32;
+int lua_fdw_cache_slot_size = 128;
+
+static LuaFdwCache *cache = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static Size
+cache_slot_bytes (void)
+{
+	return (Size) lua_fdw_cache_slot_size * 1024;
+}
+
+static Size
+cache_size (void)
+{
+	Size size;
+
+	size = offsetof(LuaFdwCache, chunks);
+	size = add_size(size, mul_size(sizeof(LuaFdwChunk), lua_fdw_cache_slots));
+	size = MAXALIGN(size);
+	size = add_size(size, mul_size(cache_slot_bytes(), lua_fdw_cache_slots));
+
+	return size;
+}
+
+static char*
+cache_data (int slot)
+{
+	Size offset;
+
+	offset = MAXALIGN(offsetof(LuaFdwCache, chunks) + sizeof(LuaFdwChunk) * lua_fdw_cache_slots);
+	return (char*) cache + offset + cache_slot_bytes() * slot;
+}
+
+static void
+cache_request (void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(cache_size());
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("lua_fdw", 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
+}
+
+static void
+cache_startup (void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	cache = ShmemInitStruct("lua_fdw bytecode cache", cache_size(), &found);
+
+	if (!found)
+	{
+		memset(cache, 0, offsetof(LuaFdwCache, chunks) + sizeof(LuaFdwChunk) * lua_fdw_cache_slots);
+#if PG_VERSION_NUM >= 90600
+		cache->lock = &(GetNamedLWLockTranche("lua_fdw"))->lock;
+#else
+		cache->lock = LWLockAssign();
+#endif
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+void
+lua_cache_init (void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable(
+		"lua_fdw.bytecode_cache_slots",
+		"Number of compiled Lua chunks kept in shared memory.",
+		NULL,
+		&lua_fdw_cache_slots,
+		32,
+		0,
+		INT_MAX / 1024,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"lua_fdw.bytecode_cache_slot_size",
+		"Largest compiled Lua chunk that fits in the shared cache.",
+		NULL,
+		&lua_fdw_cache_slot_size,
+		128,
+		1,
+		MAX_KILOBYTES,
+		PGC_POSTMASTER,
+		GUC_UNIT_KB,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	if (lua_fdw_cache_slots == 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = cache_request;
+#else
+	cache_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = cache_startup;
+}
+
+static int
+chunk_writer (lua_State *lua, const void *p, size_t sz, void *ud)
+{
+	appendBinaryStringInfo((StringInfo) ud, p, sz);
+	return 0;
+}
+
+static bool
+chunk_match (int slot, const char *path, time_t mtime, int64 size, const char *text, Size text_length, uint32 hash)
+{
+	LuaFdwChunk *chunk = &cache->chunks[slot];
+
+	if (!chunk->valid)
+		return false;
+
+	if (path)
+		return chunk->mtime == mtime && chunk->size == size && strcmp(chunk->path, path) == 0;
+
+	return chunk->path[0] == '\0'
+		&& chunk->hash == hash
+		&& chunk->text_length == text_length
+		&& memcmp(cache_data(slot), text, text_length) == 0;
+}
+
+/*
+ * Look for a chunk and, if found, load its bytecode onto the stack.
+ */
+static bool
+chunk_fetch (lua_State *lua, const char *name, const char *path, time_t mtime, int64 size, const char *text, Size text_length, uint32 hash, int *status)
+{
+	char *bytecode = NULL;
+	Size length = 0;
+	int slot;
+
+	LWLockAcquire(cache->lock, LW_SHARED);
+
+	for (slot = 0; slot < lua_fdw_cache_slots; slot++)
+	{
+		if (chunk_match(slot, path, mtime, size, text, text_length, hash))
+		{
+			length = cache->chunks[slot].length;
+			bytecode = palloc(length);
+			memcpy(bytecode, cache_data(slot) + text_length, length);
+			break;
+		}
+	}
+
+	LWLockRelease(cache->lock);
+
+	if (!bytecode)
+		return false;
+
+	*status = luaL_loadbuffer(lua, bytecode, length, name);
+	pfree(bytecode);
+
+	return true;
+}
+
+/*
+ * Dump the compiled function on top of the stack into a free (or the
+ * oldest) slot. Chunks too big for a slot are simply not cached.
+ */
+static void
+chunk_store (lua_State *lua, const char *path, time_t mtime, int64 size, const char *text, Size text_length, uint32 hash)
+{
+	StringInfoData buf;
+	LuaFdwChunk *chunk;
+	int slot, victim = -1;
+
+	initStringInfo(&buf);
+
+#if LUA_VERSION_NUM >= 503
+	lua_dump(lua, chunk_writer, &buf, 0);
+#else
+	lua_dump(lua, chunk_writer, &buf);
+#endif
+
+	if (text_length + buf.len > cache_slot_bytes())
+	{
+		pfree(buf.data);
+		return;
+	}
+
+	LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+
+	for (slot = 0; slot < lua_fdw_cache_slots; slot++)
+	{
+		/* another backend got there first */
+		if (chunk_match(slot, path, mtime, size, text, text_length, hash))
+			break;
+
+		if (victim < 0 && !cache->chunks[slot].valid)
+			victim = slot;
+	}
+
+	if (slot == lua_fdw_cache_slots)
+	{
+		if (victim < 0)
+			victim = cache->clock++ % lua_fdw_cache_slots;
+
+		chunk = &cache->chunks[victim];
+		chunk->valid = true;
+		strlcpy(chunk->path, path ? path : "", MAXPGPATH);
+		chunk->mtime = mtime;
+		chunk->size = size;
+		chunk->hash = hash;
+		chunk->text_length = text_length;
+		chunk->length = buf.len;
+
+		if (text_length > 0)
+			memcpy(cache_data(victim), text, text_length);
+
+		memcpy(cache_data(victim) + text_length, buf.data, buf.len);
+	}
+
+	LWLockRelease(cache->lock);
+	pfree(buf.data);
+}
+
+/*
+ * Drop-in replacement for luaL_loadfile.
+ */
+int
+lua_loadfile_cached (lua_State *lua, const char *path)
+{
+	struct stat st;
+	char name[MAXPGPATH + 1];
+	int status;
+
+	if (!cache || strlen(path) >= MAXPGPATH || stat(path, &st) != 0)
+		return luaL_loadfile(lua, path);
+
+	snprintf(name, sizeof(name), "@%s", path);
+
+	if (chunk_fetch(lua, name, path, st.st_mtime, st.st_size, NULL, 0, 0, &status))
+		return status;
+
+	status = luaL_loadfile(lua, path);
+
+	if (status == 0)
+		chunk_store(lua, path, st.st_mtime, st.st_size, NULL, 0, 0);
+
+	return status;
+}
+
+/*
+ * Drop-in replacement for luaL_loadstring.
+ */
+int
+lua_loadstring_cached (lua_State *lua, const char *text)
+{
+	Size text_length = strlen(text);
+	uint32 hash;
+	int status;
+
+	if (!cache)
+		return luaL_loadstring(lua, text);
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) text, text_length));
+
+	if (chunk_fetch(lua, text, NULL, 0, 0, text, text_length, hash, &status))
+		return status;
+
+	status = luaL_loadstring(lua, text);
+
+	if (status == 0)
+		chunk_store(lua, NULL, 0, 0, text, text_length, hash);
+
+	return status;
+}
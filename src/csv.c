@@ -0,0 +1,720 @@
+/*-------------------------------------------------------------------------
+ *
+ * Lua Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2016 Sean Pringle (lua_fdw)
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Andrew Dunstan <andrew@dunslane.net> (blackhole_fdw)
+ * Author: Sean Pringle <sean.pringle@gmail.com> (lua_fdw)
+ *
+ *-------------------------------------------------------------------------
+ *
+ * CSV reader for scripts, as fdw.csv.open(path, options).
+ *
+ * The file is read in large blocks and split into fields in place, looking
+ * for delimiters and newlines eight bytes at a time. Only fields that map
+ * to a column the query needs become Lua strings, and the header to column
+ * mapping is worked out once when the file is opened, so each row comes
+ * back as a table lua_fdw can put straight into a slot.
+ *
+ * Memory comes from the Lua state's allocator, so it counts towards
+ * lua_fdw.memory_limit and belongs to the state rather than a query.
+ */
+
+#include "postgres.h"
+
+#include "lua_fdw.h"
+
+#define CSV_METATABLE "lua_fdw.csv"
+#define CSV_BUFFER_SIZE (64 * 1024)
+
+#define CSV_ONES UINT64CONST(0x0101010101010101)
+#define CSV_HIGHS UINT64CONST(0x8080808080808080)
+
+typedef struct
+{
+	size_t start;
+	size_t len;
+	bool quoted;
+	bool escaped;		/* contains doubled quotes */
+} LuaFdwCsvField;
+
+typedef struct
+{
+	FILE *file;
+	bool eof;
+	int records;
+
+	/* unparsed input is buf[pos] to buf[len] */
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+
+	char delimiter;
+	char quote;
+	char *null;			/* NULL if no field is read as NULL */
+	size_t null_len;
+	bool header;
+
+	/* fields of the last record read */
+	LuaFdwCsvField *fields;
+	int nfields;
+	int fields_size;
+
+	/* column name reference for each field, or positional rows if NULL */
+	int *map;
+	int nmap;
+	int nmapped;
+	int headers_ref;
+} LuaFdwCsv;
+
+static void*
+csv_alloc (lua_State *lua, void *ptr, size_t osize, size_t nsize)
+{
+	lua_Alloc alloc;
+	void *ud;
+	void *block;
+
+	alloc = lua_getallocf(lua, &ud);
+	block = alloc(ud, ptr, ptr ? osize : 0, nsize);
+
+	if (block == NULL && nsize > 0)
+		luaL_error(lua, "not enough memory");
+
+	return block;
+}
+
+static LuaFdwCsv*
+csv_check (lua_State *lua)
+{
+	LuaFdwCsv *csv = (LuaFdwCsv *) luaL_checkudata(lua, 1, CSV_METATABLE);
+
+	if (csv->file == NULL)
+		luaL_error(lua, "attempt to use a closed CSV reader");
+
+	return csv;
+}
+
+/*
+ * Nonzero if any byte of v is zero.
+ */
+static inline uint64
+csv_haszero (uint64 v)
+{
+	return (v - CSV_ONES) & ~v & CSV_HIGHS;
+}
+
+/*
+ * Offset of the next delimiter or newline at or after pos, or len.
+ */
+static size_t
+csv_scan (const char *buf, size_t pos, size_t len, char delimiter)
+{
+	uint64 d = CSV_ONES * (unsigned char) delimiter;
+	uint64 nl = CSV_ONES * (unsigned char) '\n';
+	uint64 w;
+
+	while (pos + sizeof(w) <= len)
+	{
+		memcpy(&w, buf + pos, sizeof(w));
+
+		if (csv_haszero(w ^ d) | csv_haszero(w ^ nl))
+			break;
+
+		pos += sizeof(w);
+	}
+
+	while (pos < len && buf[pos] != delimiter && buf[pos] != '\n')
+		pos++;
+
+	return pos;
+}
+
+/*
+ * Move unparsed input to the front of the buffer, growing it if a record
+ * fills it, and read more.
+ */
+static void
+csv_fill (lua_State *lua, LuaFdwCsv *csv)
+{
+	size_t n;
+
+	if (csv->pos > 0)
+	{
+		memmove(csv->buf, csv->buf + csv->pos, csv->len - csv->pos);
+		csv->len -= csv->pos;
+		csv->pos = 0;
+	}
+
+	if (csv->len == csv->size)
+	{
+		csv->buf = csv_alloc(lua, csv->buf, csv->size, csv->size * 2);
+		csv->size *= 2;
+	}
+
+	n = fread(csv->buf + csv->len, 1, csv->size - csv->len, csv->file);
+	csv->len += n;
+
+	if (n == 0)
+	{
+		if (ferror(csv->file))
+			luaL_error(lua, "could not read CSV file: %s", strerror(errno));
+
+		csv->eof = true;
+	}
+}
+
+static void
+csv_field (lua_State *lua, LuaFdwCsv *csv, int i, size_t start, size_t end, bool quoted, bool escaped)
+{
+	LuaFdwCsvField *field;
+
+	if (i == csv->fields_size)
+	{
+		int size = csv->fields_size ? csv->fields_size * 2 : 16;
+
+		csv->fields = csv_alloc(lua, csv->fields, sizeof(LuaFdwCsvField) * csv->fields_size, sizeof(LuaFdwCsvField) * size);
+		csv->fields_size = size;
+	}
+
+	field = &csv->fields[i];
+	field->start = start;
+	field->len = end - start;
+	field->quoted = quoted;
+	field->escaped = escaped;
+}
+
+/*
+ * Split the next record into fields. Returns 1 for a record, 0 at the end
+ * of the file, or -1 if the record continues past the buffered input.
+ */
+static int
+csv_parse (lua_State *lua, LuaFdwCsv *csv)
+{
+	const char *buf = csv->buf;
+	size_t len = csv->len;
+	size_t pos = csv->pos;
+	size_t start, end;
+	int n = 0;
+
+	if (pos == len)
+		return csv->eof ? 0 : -1;
+
+	for (;;)
+	{
+		bool quoted = false;
+		bool escaped = false;
+
+		if (pos < len && buf[pos] == csv->quote)
+		{
+			const char *q;
+
+			quoted = true;
+			start = ++pos;
+
+			for (;;)
+			{
+				q = memchr(buf + pos, csv->quote, len - pos);
+
+				/* a quote at the end of the input may be the first of a pair */
+				if (q == NULL || q == buf + len - 1)
+				{
+					if (!csv->eof)
+						return -1;
+
+					if (q == NULL)
+						return luaL_error(lua, "unterminated quoted field in CSV record %d", csv->records + 1);
+				}
+
+				pos = q - buf + 1;
+
+				if (pos < len && buf[pos] == csv->quote)
+				{
+					escaped = true;
+					pos++;
+					continue;
+				}
+				break;
+			}
+
+			end = pos - 1;
+
+			if (pos < len && buf[pos] == '\r')
+			{
+				if (pos + 1 == len && !csv->eof)
+					return -1;
+
+				if (pos + 1 == len || buf[pos + 1] == '\n')
+					pos++;
+			}
+
+			if (pos < len && buf[pos] != csv->delimiter && buf[pos] != '\n')
+				return luaL_error(lua, "unexpected character after quoted field in CSV record %d", csv->records + 1);
+		}
+		else
+		{
+			start = pos;
+			pos = csv_scan(buf, pos, len, csv->delimiter);
+
+			if (pos == len && !csv->eof)
+				return -1;
+
+			end = pos;
+
+			/* CRLF line endings */
+			if (pos < len && buf[pos] == '\n' && end > start && buf[end - 1] == '\r')
+				end--;
+		}
+
+		csv_field(lua, csv, n++, start, end, quoted, escaped);
+
+		if (pos < len && buf[pos] == csv->delimiter)
+		{
+			pos++;
+			continue;
+		}
+
+		/* newline, or the end of the file */
+		if (pos < len)
+			pos++;
+		break;
+	}
+
+	csv->pos = pos;
+	csv->nfields = n;
+	csv->records++;
+
+	return 1;
+}
+
+/*
+ * Read the next record, skipping blank lines. False at the end of the file.
+ */
+static bool
+csv_next (lua_State *lua, LuaFdwCsv *csv)
+{
+	int status;
+
+	for (;;)
+	{
+		while ((status = csv_parse(lua, csv)) < 0)
+			csv_fill(lua, csv);
+
+		if (status == 0)
+			return false;
+
+		if (csv->nfields > 1 || csv->fields[0].quoted || csv->fields[0].len > 0)
+			return true;
+	}
+}
+
+/*
+ * Push field i, returning false without pushing anything if it is NULL.
+ */
+static bool
+csv_push_field (lua_State *lua, LuaFdwCsv *csv, int i)
+{
+	LuaFdwCsvField *field = &csv->fields[i];
+	const char *value = csv->buf + field->start;
+
+	if (csv->null && !field->quoted && field->len == csv->null_len
+		&& memcmp(value, csv->null, csv->null_len) == 0)
+		return false;
+
+	if (field->escaped)
+	{
+		luaL_Buffer b;
+		size_t j;
+
+		luaL_buffinit(lua, &b);
+
+		for (j = 0; j < field->len; j++)
+		{
+			luaL_addchar(&b, value[j]);
+
+			if (value[j] == csv->quote)
+				j++;
+		}
+		luaL_pushresult(&b);
+	}
+	else
+		lua_pushlstring(lua, value, field->len);
+
+	return true;
+}
+
+/*
+ * Push the last record as a row: keyed by column name for the fields that
+ * map to one, or positional with fdw.NULL holes.
+ */
+static void
+csv_push_row (lua_State *lua, LuaFdwCsv *csv)
+{
+	int i;
+
+	if (csv->map)
+	{
+		lua_createtable(lua, 0, csv->nmapped);
+
+		for (i = 0; i < csv->nfields && i < csv->nmap; i++)
+		{
+			if (csv->map[i] == LUA_NOREF)
+				continue;
+
+			lua_rawgeti(lua, LUA_REGISTRYINDEX, csv->map[i]);
+
+			if (csv_push_field(lua, csv, i))
+				lua_rawset(lua, -3);
+			else
+				lua_pop(lua, 1);
+		}
+	}
+	else
+	{
+		lua_createtable(lua, csv->nfields, 0);
+
+		for (i = 0; i < csv->nfields; i++)
+		{
+			if (!csv_push_field(lua, csv, i))
+				lua_pushlightuserdata(lua, NULL);
+
+			lua_rawseti(lua, -2, i + 1);
+		}
+	}
+}
+
+/*
+ * Whether a column is wanted: referenced by the query if fdw.target is
+ * set, else one of fdw.columns, else any name at all.
+ */
+static bool
+csv_wanted (lua_State *lua, const char *name)
+{
+	bool wanted = true;
+
+	lua_getglobal(lua, "fdw");
+
+	if (lua_istable(lua, -1))
+	{
+		lua_getfield(lua, -1, "target");
+
+		if (!lua_istable(lua, -1))
+		{
+			lua_pop(lua, 1);
+			lua_getfield(lua, -1, "columns");
+		}
+
+		if (lua_istable(lua, -1))
+		{
+			lua_getfield(lua, -1, name);
+			wanted = !lua_isnil(lua, -1);
+			lua_pop(lua, 1);
+		}
+		lua_pop(lua, 1);
+	}
+	lua_pop(lua, 1);
+
+	return wanted;
+}
+
+/*
+ * Map the values in the table at index to columns, by position.
+ */
+static void
+csv_map (lua_State *lua, LuaFdwCsv *csv, int index)
+{
+	int i, n = (int) lua_rawlen(lua, index);
+
+	csv->map = csv_alloc(lua, NULL, 0, sizeof(int) * Max(n, 1));
+	csv->nmap = n;
+
+	for (i = 0; i < n; i++)
+		csv->map[i] = LUA_NOREF;
+
+	for (i = 0; i < n; i++)
+	{
+		lua_rawgeti(lua, index, i + 1);
+
+		if (lua_type(lua, -1) == LUA_TSTRING && csv_wanted(lua, lua_tostring(lua, -1)))
+		{
+			csv->map[i] = luaL_ref(lua, LUA_REGISTRYINDEX);
+			csv->nmapped++;
+		}
+		else
+			lua_pop(lua, 1);
+	}
+}
+
+static char
+csv_option_char (lua_State *lua, int index, const char *name, char fallback)
+{
+	const char *value;
+	size_t len;
+
+	lua_getfield(lua, index, name);
+
+	if (lua_isnil(lua, -1))
+	{
+		lua_pop(lua, 1);
+		return fallback;
+	}
+
+	value = lua_tolstring(lua, -1, &len);
+
+	if (value == NULL || len != 1 || value[0] == '\n' || value[0] == '\r')
+		luaL_error(lua, "CSV %s must be a single character", name);
+
+	lua_pop(lua, 1);
+	return value[0];
+}
+
+/*
+ * fdw.csv.open(path [, options]): a reader, or nil and a message if the
+ * file can't be opened.
+ */
+static int
+csv_open (lua_State *lua)
+{
+	const char *path = luaL_checkstring(lua, 1);
+	const char *null = "";
+	LuaFdwCsv *csv;
+	int i;
+
+	csv = (LuaFdwCsv *) lua_newuserdata(lua, sizeof(LuaFdwCsv));
+	memset(csv, 0, sizeof(LuaFdwCsv));
+	csv->headers_ref = LUA_NOREF;
+	csv->delimiter = ',';
+	csv->quote = '"';
+	csv->header = true;
+
+	luaL_getmetatable(lua, CSV_METATABLE);
+	lua_setmetatable(lua, -2);
+
+	if (lua_istable(lua, 2))
+	{
+		csv->delimiter = csv_option_char(lua, 2, "delimiter", ',');
+		csv->quote = csv_option_char(lua, 2, "quote", '"');
+
+		if (csv->delimiter == csv->quote)
+			luaL_error(lua, "CSV delimiter and quote must differ");
+
+		lua_getfield(lua, 2, "header");
+		if (!lua_isnil(lua, -1))
+			csv->header = lua_toboolean(lua, -1);
+		lua_pop(lua, 1);
+
+		/* null = false reads every field as a string */
+		lua_getfield(lua, 2, "null");
+		if (lua_isstring(lua, -1))
+			null = lua_tostring(lua, -1);
+		else
+		if (lua_isboolean(lua, -1) && !lua_toboolean(lua, -1))
+			null = NULL;
+		lua_pop(lua, 1);
+	}
+
+	if (null)
+	{
+		csv->null_len = strlen(null);
+		csv->null = csv_alloc(lua, NULL, 0, csv->null_len + 1);
+		memcpy(csv->null, null, csv->null_len + 1);
+	}
+
+	csv->buf = csv_alloc(lua, NULL, 0, CSV_BUFFER_SIZE);
+	csv->size = CSV_BUFFER_SIZE;
+
+	csv->file = fopen(path, "rb");
+
+	if (csv->file == NULL)
+	{
+		const char *message = strerror(errno);
+
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: %s", path, message);
+		return 2;
+	}
+
+	if (csv->header && csv_next(lua, csv))
+	{
+		lua_createtable(lua, csv->nfields, 0);
+
+		for (i = 0; i < csv->nfields; i++)
+		{
+			if (!csv_push_field(lua, csv, i))
+				lua_pushliteral(lua, "");
+
+			lua_rawseti(lua, -2, i + 1);
+		}
+		csv->headers_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+	}
+
+	/* explicit column names win over the header line */
+	if (lua_istable(lua, 2))
+		lua_getfield(lua, 2, "columns");
+	else
+		lua_pushnil(lua);
+
+	if (lua_istable(lua, -1))
+		csv_map(lua, csv, lua_gettop(lua));
+	else
+	if (csv->headers_ref != LUA_NOREF)
+	{
+		lua_rawgeti(lua, LUA_REGISTRYINDEX, csv->headers_ref);
+		csv_map(lua, csv, lua_gettop(lua));
+		lua_pop(lua, 1);
+	}
+	lua_pop(lua, 1);
+
+	return 1;
+}
+
+/*
+ * reader:read(): the next row, or nil at the end of the file.
+ */
+static int
+csv_read (lua_State *lua)
+{
+	LuaFdwCsv *csv = csv_check(lua);
+
+	if (csv_next(lua, csv))
+		csv_push_row(lua, csv);
+	else
+		lua_pushnil(lua);
+
+	return 1;
+}
+
+/*
+ * reader:read_batch(n): an array of up to n rows, empty at the end of the
+ * file. Suits ScanIterateBatch(n).
+ */
+static int
+csv_read_batch (lua_State *lua)
+{
+	LuaFdwCsv *csv = csv_check(lua);
+	int n = (int) luaL_checkinteger(lua, 2);
+	int i = 0;
+
+	lua_createtable(lua, n > 0 ? n : 0, 0);
+
+	while (i < n && csv_next(lua, csv))
+	{
+		csv_push_row(lua, csv);
+		lua_rawseti(lua, -2, ++i);
+	}
+
+	return 1;
+}
+
+/*
+ * reader:headers(): the names on the header line, or nil without one.
+ */
+static int
+csv_headers (lua_State *lua)
+{
+	LuaFdwCsv *csv = csv_check(lua);
+
+	if (csv->headers_ref == LUA_NOREF)
+		lua_pushnil(lua);
+	else
+		lua_rawgeti(lua, LUA_REGISTRYINDEX, csv->headers_ref);
+
+	return 1;
+}
+
+/*
+ * reader:rewind(): start again from the first row.
+ */
+static int
+csv_rewind (lua_State *lua)
+{
+	LuaFdwCsv *csv = csv_check(lua);
+
+	if (fseek(csv->file, 0, SEEK_SET) != 0)
+		return luaL_error(lua, "could not seek CSV file: %s", strerror(errno));
+
+	csv->eof = false;
+	csv->records = 0;
+	csv->len = 0;
+	csv->pos = 0;
+
+	if (csv->header)
+		csv_next(lua, csv);
+
+	return 0;
+}
+
+/*
+ * reader:close(), also run by the garbage collector.
+ */
+static int
+csv_close (lua_State *lua)
+{
+	LuaFdwCsv *csv = (LuaFdwCsv *) luaL_checkudata(lua, 1, CSV_METATABLE);
+	int i;
+
+	if (csv->file)
+		fclose(csv->file);
+
+	for (i = 0; i < csv->nmap; i++)
+		luaL_unref(lua, LUA_REGISTRYINDEX, csv->map[i]);
+
+	luaL_unref(lua, LUA_REGISTRYINDEX, csv->headers_ref);
+
+	csv_alloc(lua, csv->buf, csv->size, 0);
+	if (csv->null)
+		csv_alloc(lua, csv->null, csv->null_len + 1, 0);
+	csv_alloc(lua, csv->fields, sizeof(LuaFdwCsvField) * csv->fields_size, 0);
+	csv_alloc(lua, csv->map, sizeof(int) * Max(csv->nmap, 1), 0);
+
+	memset(csv, 0, sizeof(LuaFdwCsv));
+	csv->headers_ref = LUA_NOREF;
+
+	return 0;
+}
+
+static const luaL_Reg csv_methods[] = {
+	{"read", csv_read},
+	{"read_batch", csv_read_batch},
+	{"headers", csv_headers},
+	{"rewind", csv_rewind},
+	{"close", csv_close},
+	{NULL, NULL}
+};
+
+/*
+ * Push the fdw.csv table.
+ */
+void
+lua_csv_push (lua_State *lua)
+{
+	const luaL_Reg *reg;
+
+	if (luaL_newmetatable(lua, CSV_METATABLE))
+	{
+		lua_createtable(lua, 0, 0);
+
+		for (reg = csv_methods; reg->name; reg++)
+		{
+			lua_pushcfunction(lua, reg->func);
+			lua_setfield(lua, -2, reg->name);
+		}
+		lua_setfield(lua, -2, "__index");
+
+		lua_pushcfunction(lua, csv_close);
+		lua_setfield(lua, -2, "__gc");
+
+#if LUA_VERSION_NUM >= 504
+		lua_pushcfunction(lua, csv_close);
+		lua_setfield(lua, -2, "__close");
+#endif
+	}
+	lua_pop(lua, 1);
+
+	lua_createtable(lua, 0, 1);
+	lua_pushcfunction(lua, csv_open);
+	lua_setfield(lua, -2, "open");
+}
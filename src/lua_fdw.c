@@ -12,37 +12,107 @@
  *-------------------------------------------------------------------------
  */
 
-#include <lua.h>
-#include <lauxlib.h>
-#include <lualib.h>
+#include <math.h>
 
 #include "postgres.h"
 
 #include "access/reloptions.h"
 #include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#else
+#include "access/heapam.h"
+#endif
+#include "access/sysattr.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#if PG_VERSION_NUM >= 100000
+#include "access/stratnum.h"
+#else
+#include "access/skey.h"
+#endif
+#if PG_VERSION_NUM >= 90600
+#include "access/parallel.h"
+#endif
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
+#include "executor/executor.h"
+#if PG_VERSION_NUM >= 140000
+#include "executor/execAsync.h"
+#endif
+#include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#if PG_VERSION_NUM >= 140000
+#include "optimizer/appendinfo.h"
+#endif
+#include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#include "optimizer/tlist.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/clauses.h"
+#include "optimizer/var.h"
+#endif
 #include "catalog/pg_foreign_server.h"
 #include "catalog/pg_foreign_table.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_namespace.h"
 #include "catalog/pg_operator.h"
+#include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/tablecmds.h"
 #include "commands/explain.h"
+#include "commands/vacuum.h"
 #include "utils/rel.h"
 #include "utils/memutils.h"
+#include "utils/pg_locale.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include "utils/syscache.h"
 #include "utils/lsyscache.h"
+#include "utils/sampling.h"
+#include "utils/selfuncs.h"
 #include "utils/timestamp.h"
+#include "utils/typcache.h"
 #include "funcapi.h"
 #include "nodes/makefuncs.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "tcop/tcopprot.h"
+#if PG_VERSION_NUM >= 100000
+#include "pgstat.h"
+#endif
+
+#include "lua_fdw.h"
+
+/* names older releases don't have */
+#if PG_VERSION_NUM < 120000
+#define table_open(r, l) heap_open(r, l)
+#define table_close(r, l) heap_close(r, l)
+#endif
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
 
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+
+#if PG_VERSION_NUM >= 90600
+PGDLLEXPORT void lua_prefetch_main(Datum main_arg);
+#endif
+
 /*
  * SQL functions
  */
@@ -52,32 +122,6 @@ extern Datum lua_fdw_validator(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(lua_fdw_handler);
 PG_FUNCTION_INFO_V1(lua_fdw_validator);
 
-int
-lua_callback (
-	lua_State *lua,
-	const char *func,
-	int args,
-	int results
-);
-
-lua_State*
-lua_start (
-	const char *script,
-	const char *inject,
-	const char *lua_path,
-	const char *lua_cpath
-);
-
-void
-lua_stop (
-	lua_State *lua
-);
-
-int
-lua_ereport (
-	lua_State *lua
-);
-
 static bool
 is_valid_option (
 	const char *option,
@@ -132,12 +176,82 @@ luaEndForeignScan(
 	ForeignScanState *node
 );
 
+#if PG_VERSION_NUM >= 90600
+static bool
+luaIsForeignScanParallelSafe(
+	PlannerInfo *root,
+	RelOptInfo *rel,
+	RangeTblEntry *rte
+);
+
+static Size
+luaEstimateDSMForeignScan(
+	ForeignScanState *node,
+	ParallelContext *pcxt
+);
+
+static void
+luaInitializeDSMForeignScan(
+	ForeignScanState *node,
+	ParallelContext *pcxt,
+	void *coordinate
+);
+
+static void
+luaInitializeWorkerForeignScan(
+	ForeignScanState *node,
+	shm_toc *toc,
+	void *coordinate
+);
+#endif
+
+#if PG_VERSION_NUM >= 100000
+static void
+luaReInitializeDSMForeignScan(
+	ForeignScanState *node,
+	ParallelContext *pcxt,
+	void *coordinate
+);
+#endif
+
+#if PG_VERSION_NUM >= 140000
+static bool
+luaIsForeignPathAsyncCapable(
+	ForeignPath *path
+);
+
+static void
+luaForeignAsyncRequest(
+	AsyncRequest *areq
+);
+
+static void
+luaForeignAsyncConfigureWait(
+	AsyncRequest *areq
+);
+
+static void
+luaForeignAsyncNotify(
+	AsyncRequest *areq
+);
+#endif
+
+#if PG_VERSION_NUM >= 140000
+static void
+luaAddForeignUpdateTargets(
+	PlannerInfo *root,
+	Index rtindex,
+	RangeTblEntry *target_rte,
+	Relation target_relation
+);
+#else
 static void
 luaAddForeignUpdateTargets(
 	Query *parsetree,
 	RangeTblEntry *target_rte,
 	Relation target_relation
 );
+#endif
 
 static List
 *luaPlanForeignModify(
@@ -186,6 +300,36 @@ luaEndForeignModify(
 	ResultRelInfo *rinfo
 );
 
+#if PG_VERSION_NUM >= 110000
+static void
+luaBeginForeignInsert(
+	ModifyTableState *mtstate,
+	ResultRelInfo *rinfo
+);
+
+static void
+luaEndForeignInsert(
+	EState *estate,
+	ResultRelInfo *rinfo
+);
+#endif
+
+#if PG_VERSION_NUM >= 140000
+static TupleTableSlot
+**luaExecForeignBatchInsert(
+	EState *estate,
+	ResultRelInfo *rinfo,
+	TupleTableSlot **slots,
+	TupleTableSlot **planSlots,
+	int *numSlots
+);
+
+static int
+luaGetForeignModifyBatchSize(
+	ResultRelInfo *rinfo
+);
+#endif
+
 static int
 luaIsForeignRelUpdatable(
 	Relation rel
@@ -213,6 +357,25 @@ luaAnalyzeForeignTable(
 	BlockNumber *totalpages
 );
 
+#if PG_VERSION_NUM >= 110000
+static void
+luaGetForeignUpperPaths(
+	PlannerInfo *root,
+	UpperRelationKind stage,
+	RelOptInfo *input_rel,
+	RelOptInfo *output_rel,
+	void *extra
+);
+#elif PG_VERSION_NUM >= 100000
+static void
+luaGetForeignUpperPaths(
+	PlannerInfo *root,
+	UpperRelationKind stage,
+	RelOptInfo *input_rel,
+	RelOptInfo *output_rel
+);
+#endif
+
 static void
 luaGetForeignJoinPaths(
 	PlannerInfo *root,
@@ -229,6 +392,16 @@ luaGetForeignRowMarkType(
 	LockClauseStrength strength
 );
 
+#if PG_VERSION_NUM >= 120000
+static void
+luaRefetchForeignRow(
+	EState *estate,
+	ExecRowMark *erm,
+	Datum rowid,
+	TupleTableSlot *slot,
+	bool *updated
+);
+#else
 static HeapTuple
 luaRefetchForeignRow(
 	EState *estate,
@@ -236,6 +409,7 @@ luaRefetchForeignRow(
 	Datum rowid,
 	bool *updated
 );
+#endif
 
 static List
 *luaImportForeignSchema(
@@ -261,13 +435,75 @@ struct luaFdwOption
 
 /*
  * The plan state is set up in luaGetForeignRelSize and stashed away in
- * baserel->fdw_private and fetched in luaGetForeignPaths.
+ * baserel->fdw_private and fetched in luaGetForeignPaths. Join rels get one
+ * from luaGetForeignJoinPaths, borrowing the outer table's Lua state.
  */
 typedef struct
 {
 	lua_State *lua;
+	bool async_capable;
+	int64 limit;			/* rows a LIMIT needs from this scan, 0 if unknown */
+	List *exact_clauses;	/* RestrictInfos PlanClauses applies exactly */
+	double fetched_rows;	/* rows the script returns, before local quals */
+
+	/* join rels only */
+	RelOptInfo *outerrel;
+	RelOptInfo *innerrel;
+	List *join_quals;		/* checked locally on the joined rows */
+	List *join_vars;		/* columns the join scan returns */
+	List *join_clauses;		/* [outer column, operator, inner column] */
+
+	/* upper rels only */
+	List *scan_tlist;		/* grouping columns and aggregates */
+	List *upper_private;	/* fdw_private after the common entries */
 } LuaFdwPlanState;
 
+/*
+ * Entries of a ForeignScan's fdw_private. Joins and aggregates (scanrelid
+ * 0) follow the common entries with the tables involved and a description
+ * of the work pushed down.
+ */
+enum LuaFdwScanPrivateIndex
+{
+	LuaFdwPrivateOptions,		/* script, inject, lua_path and lua_cpath */
+	LuaFdwPrivateAttrs,			/* attribute numbers the query needs */
+	LuaFdwPrivateParams,		/* attribute numbers of nested loop keys */
+	LuaFdwPrivateOrderBy,		/* [column, direction, nulls] for fdw.order_by */
+	LuaFdwPrivateLimit,			/* Integer for fdw.limit, 0 if none */
+	LuaFdwPrivateRelids,		/* the joined tables, or the table aggregated */
+	LuaFdwPrivateAliases = 6,	/* joins: range table aliases */
+	LuaFdwPrivateJoinClauses,	/* joins: [outer column, operator, inner column] */
+	LuaFdwPrivateGroups = 6,	/* aggregates: GROUP BY column names */
+	LuaFdwPrivateAggs,			/* aggregates: [name, func, column] */
+	LuaFdwPrivateQuals			/* aggregates: WHERE clauses */
+};
+
+/*
+ * Per-attribute conversion to and from Lua values, resolved once per scan
+ * or modify so the row loop does no catalog access.
+ */
+typedef struct
+{
+	bool dropped;
+	bool needed;		/* referenced by the query, see fdw.target */
+	int name_ref;		/* interned column name in the registry */
+	Oid typid;
+	FmgrInfo input;
+	Oid typioparam;
+	int32 typmod;
+	FmgrInfo output;
+} LuaFdwColumn;
+
+/*
+ * Coordination for parallel scans, in DSM when running under Gather or
+ * local to the scan otherwise. See fdw.next_chunk().
+ */
+typedef struct
+{
+	pg_atomic_uint64 next_chunk;
+	int nworkers;
+} LuaFdwParallelState;
+
 /*
  * The scan state is for maintaining state for a scan, eiher for a
  * SELECT or UPDATE or DELETE.
@@ -279,6 +515,57 @@ typedef struct
 typedef struct
 {
 	lua_State *lua;
+	LuaFdwColumn *columns;
+
+	/* nested loop parameters, evaluated into fdw.params on (re)scan */
+	List *param_exprs;
+	List *param_attrs;
+
+	/* Params in the quals, evaluated after those into fdw.clauses */
+	List *clause_params;
+	List *quals;
+
+	/* ScanStart/ScanRestart deferred to the next iteration */
+	bool start_pending;
+	bool started;
+
+	/* rows returned so far, and the most a LIMIT will take */
+	int64 rows_fetched;
+	int64 limit;
+
+	LuaFdwParallelState *shared;
+	LuaFdwParallelState local;
+
+	/* callbacks held in the registry for the whole scan */
+	int iterate_fn;
+	int iterate_batch_fn;
+
+	/* ScanIterate run as a coroutine that may yield a socket to wait on */
+	bool use_coroutine;
+	bool async;			/* under an async Append, which does the waiting */
+	lua_State *thread;
+	int thread_ref;
+	bool running;
+	bool waiting;
+	pgsocket wait_fd;
+	int wait_events;
+
+	/* rows from ScanIterateBatch, drained across IterateForeignScan calls */
+	bool use_batch;
+	int fetch_size;
+	int batch_ref;
+	int batch_len;
+	int batch_pos;
+	bool batch_done;
+
+#if PG_VERSION_NUM >= 90600
+	/* rows produced by a background worker running the script */
+	bool prefetch;
+	bool prefetch_done;
+	dsm_segment *prefetch_seg;
+	shm_mq_handle *prefetch_mq;
+	BackgroundWorkerHandle *prefetch_worker;
+#endif
 } LuaFdwScanState;
 
 /*
@@ -292,8 +579,34 @@ typedef struct
 typedef struct
 {
 	lua_State *lua;
+	LuaFdwColumn *columns;
+	int natts;
+	CmdType operation;
+	bool started;
+
+	/* whole-row junk column carrying the row being updated or deleted */
+	AttrNumber oldrow_attno;
+
+	int insert_fn;
+	int insert_batch_fn;
+	int update_fn;
+	int delete_fn;
+	int batch_size;
+
+	/* COPY and tuple routing: rows held in C until InsertBatch(rows) */
+	MemoryContext chunk_cxt;
+	HeapTuple *chunk;
+	int chunk_len;
+	int chunk_size;
 } LuaFdwModifyState;
 
+/* junk column for UPDATE/DELETE; PostgreSQL 14+ shares the core's own */
+#if PG_VERSION_NUM >= 140000
+#define LUA_FDW_OLDROW "wholerow"
+#else
+#define LUA_FDW_OLDROW "lua_fdw_oldrow"
+#endif
+
 /*
  * Valid options for lua_fdw.
  */
@@ -302,6 +615,16 @@ static const struct luaFdwOption valid_options[] = {
 	{"inject", ForeignTableRelationId},
 	{"lua_path", ForeignTableRelationId},
 	{"lua_cpath", ForeignTableRelationId},
+	{"fetch_size", ForeignTableRelationId},
+	{"parallel", ForeignTableRelationId},
+	{"async_capable", ForeignTableRelationId},
+	{"prefetch", ForeignTableRelationId},
+	{"batch_size", ForeignTableRelationId},
+	{"copy_batch_size", ForeignTableRelationId},
+	{"fdw_startup_cost", ForeignServerRelationId},
+	{"fdw_startup_cost", ForeignTableRelationId},
+	{"fdw_tuple_cost", ForeignServerRelationId},
+	{"fdw_tuple_cost", ForeignTableRelationId},
 
 //	/* Format options */
 //	/* oids option is not supported */
@@ -328,7 +651,7 @@ lua_callback (lua_State *lua, const char *func, int args, int results)
 
 	if (lua_isfunction(lua, argf))
 	{
-		if (lua_pcall(lua, args, results, 0) == 0)
+		if (lua_pcall_limited(lua, args, results) == 0)
 			return 1;
 
 		ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
@@ -340,35 +663,147 @@ lua_callback (lua_State *lua, const char *func, int args, int results)
 	return 0;
 }
 
+/*
+ * Registry reference to a global function, LUA_NOREF if it isn't defined.
+ * Saves a global lookup on every call in per-row paths.
+ */
+int
+lua_function_ref (lua_State *lua, const char *func)
+{
+	lua_getglobal(lua, func);
+
+	if (lua_isfunction(lua, -1))
+		return luaL_ref(lua, LUA_REGISTRYINDEX);
+
+	lua_pop(lua, 1);
+	return LUA_NOREF;
+}
+
+/*
+ * As lua_callback, for a function from lua_function_ref.
+ */
+int
+lua_callback_ref (lua_State *lua, int ref, int args, int results)
+{
+	if (ref == LUA_NOREF)
+	{
+		lua_pop(lua, args);
+		return 0;
+	}
+
+	lua_rawgeti(lua, LUA_REGISTRYINDEX, ref);
+	lua_insert(lua, -(args+1));
+
+	if (lua_pcall_limited(lua, args, results) == 0)
+		return 1;
+
+	ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
+	return 0;
+}
+
 lua_State*
 lua_start (const char *script, const char *inject, const char *lua_path, const char *lua_cpath)
 {
 	lua_State *lua;
 	char scratch[1024];
 
-	lua = luaL_newstate();
-	luaL_openlibs(lua);
+	lua = lua_newstate_context();
 
-	if (lua_path)
+	/* a state that failed to start isn't in the pool yet, close it here */
+	PG_TRY();
 	{
-		snprintf(scratch, 1024, "package.path = package.path .. ';%s'", lua_path);
-		if (luaL_dostring(lua, scratch) != 0)
+		luaL_openlibs(lua);
+
+		if (lua_path)
+		{
+			snprintf(scratch, 1024, "package.path = package.path .. ';%s'", lua_path);
+			if (luaL_dostring(lua, scratch) != 0)
+				ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
+		}
+
+		if (lua_cpath)
+		{
+			snprintf(scratch, 1024, "package.cpath = package.cpath .. ';%s'", lua_cpath);
+			if (luaL_dostring(lua, scratch) != 0)
+				ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
+		}
+
+		lua_globals(lua);
+
+		/* loading the script runs its top level, so it counts against the limit */
+		if ((script && (lua_loadfile_cached(lua, script) || lua_pcall_limited(lua, 0, LUA_MULTRET)))
+			|| (inject && (lua_loadstring_cached(lua, inject) || lua_pcall_limited(lua, 0, LUA_MULTRET))))
 			ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
 	}
-
-	if (lua_cpath)
+	PG_CATCH();
 	{
-		snprintf(scratch, 1024, "package.cpath = package.cpath .. ';%s'", lua_cpath);
-		if (luaL_dostring(lua, scratch) != 0)
-			ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
+		lua_close_context(lua);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
+	return lua;
+}
+
+/*
+ * fdw.gc_step([kb]): run an incremental garbage collection step worth about
+ * kb kilobytes of allocation, so a script can collect between rows or
+ * batches instead of pausing for a full collection. Returns true when the
+ * step finished a cycle.
+ */
+static int
+lua_gc_step (lua_State *lua)
+{
+	int kb = lua_isnumber(lua, 1) ? (int) lua_tonumber(lua, 1) : 0;
+
+	lua_pushboolean(lua, lua_gc(lua, LUA_GCSTEP, kb));
+	return 1;
+}
+
+/*
+ * fdw.memory_used(): bytes allocated by this Lua state.
+ */
+static int
+lua_memory (lua_State *lua)
+{
+	lua_pushnumber(lua, (lua_Number) lua_memory_used(lua));
+	return 1;
+}
+
+/*
+ * (Re)build the global fdw table. Called for fresh states and again each
+ * time a pooled state is handed out, so nothing leaks between queries.
+ */
+void
+lua_globals (lua_State *lua)
+{
 	lua_createtable(lua, 0, 0);
 
 	lua_pushstring(lua, "ereport");
 	lua_pushcfunction(lua, lua_ereport);
 	lua_settable(lua, -3);
 
+	lua_pushstring(lua, "gc_step");
+	lua_pushcfunction(lua, lua_gc_step);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "memory_used");
+	lua_pushcfunction(lua, lua_memory);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "csv");
+	lua_csv_push(lua);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "socketpair");
+	lua_socket_push(lua);
+	lua_settable(lua, -3);
+
+	/* SQL NULL, for positional rows or anywhere nil won't do */
+	lua_pushstring(lua, "NULL");
+	lua_pushlightuserdata(lua, NULL);
+	lua_settable(lua, -3);
+
 	lua_pushstring(lua, "DEBUG5");
 	lua_pushnumber(lua, DEBUG5);
 	lua_settable(lua, -3);
@@ -418,17 +853,12 @@ lua_start (const char *script, const char *inject, const char *lua_path, const c
 	lua_settable(lua, -3);
 
 	lua_setglobal(lua, "fdw");
-
-	if ((script && luaL_dofile(lua, script) != 0) || (inject && luaL_dostring(lua, inject) != 0))
-		ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(lua, -1))));
-
-	return lua;
 }
 
 void
 lua_stop (lua_State *lua)
 {
-	lua_close(lua);
+	lua_close_context(lua);
 }
 
 int
@@ -441,6 +871,14 @@ lua_ereport (lua_State *lua)
 	return 0;
 }
 
+void
+_PG_init (void)
+{
+	lua_pool_init();
+	lua_cache_init();
+	lua_alloc_init();
+}
+
 /*
  * Check if the provided option is one of the valid options.
  * context is the Oid of the catalog holding the object the option is for.
@@ -459,55 +897,239 @@ is_valid_option (const char *option, Oid context)
 }
 
 
-Datum
-lua_fdw_handler (PG_FUNCTION_ARGS)
+/*
+ * Parse a numeric option, complaining if it is below min.
+ */
+static int
+lua_option_int (DefElem *def, int min)
 {
-	FdwRoutine *fdwroutine = makeNode(FdwRoutine);
+	char *value = defGetString(def);
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(value, &end, 10);
+
+	if (errno != 0 || *end != '\0' || n < min || n > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				errmsg("invalid value for option \"%s\": \"%s\"", def->defname, value),
+				errhint("Value must be an integer no less than %d.", min)
+			)
+		);
+
+	return (int) n;
+}
 
-	/*
-	 * assign the handlers for the FDW
-	 *
-	 * This function might be called a number of times. In particular, it is
-	 * likely to be called for each INSERT statement. For an explanation, see
-	 * core postgres file src/optimizer/plan/createplan.c where it calls
-	 * GetFdwRoutineByRelId(().
-	 */
+/*
+ * Parse a cost option, complaining if it is negative.
+ */
+static double
+lua_option_cost (DefElem *def)
+{
+	char *value = defGetString(def);
+	char *end;
+	double n;
+
+	errno = 0;
+	n = strtod(value, &end);
+
+	if (errno != 0 || *end != '\0' || end == value || n < 0 || isnan(n))
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				errmsg("invalid value for option \"%s\": \"%s\"", def->defname, value),
+				errhint("Value must be a number no less than 0.")
+			)
+		);
+
+	return n;
+}
 
-	/* Required by notations: S=SELECT I=INSERT U=UPDATE D=DELETE */
+/*
+ * Look up a cost option on a foreign table, then on its server.
+ */
+static double
+lua_cost (Oid foreigntableid, const char *name, double fallback)
+{
+	ForeignTable *table = GetForeignTable(foreigntableid);
+	ForeignServer *server = GetForeignServer(table->serverid);
+	ListCell *cell;
 
-	/* these are required */
-	fdwroutine->GetForeignRelSize = luaGetForeignRelSize; /* S U D */
-	fdwroutine->GetForeignPaths = luaGetForeignPaths;		/* S U D */
-	fdwroutine->GetForeignPlan = luaGetForeignPlan;		/* S U D */
-	fdwroutine->BeginForeignScan = luaBeginForeignScan;	/* S U D */
-	fdwroutine->IterateForeignScan = luaIterateForeignScan;		/* S */
-	fdwroutine->ReScanForeignScan = luaReScanForeignScan; /* S */
-	fdwroutine->EndForeignScan = luaEndForeignScan;		/* S U D */
+	foreach(cell, list_concat(list_copy(table->options), server->options))
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
 
-	/* remainder are optional - use NULL if not required */
-	/* support for insert / update / delete */
-	fdwroutine->IsForeignRelUpdatable = luaIsForeignRelUpdatable;
-	fdwroutine->AddForeignUpdateTargets = luaAddForeignUpdateTargets;		/* U D */
-	fdwroutine->PlanForeignModify = luaPlanForeignModify; /* I U D */
-	fdwroutine->BeginForeignModify = luaBeginForeignModify;		/* I U D */
-	fdwroutine->ExecForeignInsert = luaExecForeignInsert; /* I */
-	fdwroutine->ExecForeignUpdate = luaExecForeignUpdate; /* U */
-	fdwroutine->ExecForeignDelete = luaExecForeignDelete; /* D */
-	fdwroutine->EndForeignModify = luaEndForeignModify;	/* I U D */
+		if (strcmp(def->defname, name) == 0)
+			return lua_option_cost(def);
+	}
+	return fallback;
+}
 
-	/* support for EXPLAIN */
-	fdwroutine->ExplainForeignScan = luaExplainForeignScan;		/* EXPLAIN S U D */
-	fdwroutine->ExplainForeignModify = luaExplainForeignModify;	/* EXPLAIN I U D */
+/*
+ * Look up an option on a foreign table, NULL if not set.
+ */
+static DefElem*
+lua_option (Oid foreigntableid, const char *name)
+{
+	ForeignTable *table = GetForeignTable(foreigntableid);
+	ListCell *cell;
 
-	/* support for ANALYSE */
-	fdwroutine->AnalyzeForeignTable = luaAnalyzeForeignTable;		/* ANALYZE only */
+	foreach(cell, table->options)
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
+
+		if (strcmp(def->defname, name) == 0)
+			return def;
+	}
+	return NULL;
+}
+
+/*
+ * The options that decide which Lua state a table needs, as a list of
+ * DefElems that can be stored in a plan.
+ */
+static List*
+lua_table_options (Oid foreigntableid)
+{
+	ForeignTable *table = GetForeignTable(foreigntableid);
+	List *options = NIL;
+	ListCell *cell;
+
+	foreach(cell, table->options)
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
+
+		if (strcmp(def->defname, "script") == 0
+			|| strcmp(def->defname, "inject") == 0
+			|| strcmp(def->defname, "lua_path") == 0
+			|| strcmp(def->defname, "lua_cpath") == 0)
+			options = lappend(options, copyObject(def));
+	}
+	return options;
+}
+
+/*
+ * Get a Lua state for a list of script options.
+ */
+static lua_State*
+lua_options_acquire (List *options)
+{
+	ListCell *cell;
+	const char *script = NULL;
+	const char *inject = NULL;
+	const char *lua_path = NULL;
+	const char *lua_cpath = NULL;
+
+	foreach(cell, options)
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
+
+		if (strcmp(def->defname, "script") == 0)
+			script = defGetString(def);
+
+		if (strcmp(def->defname, "inject") == 0)
+			inject = defGetString(def);
+
+		if (strcmp(def->defname, "lua_path") == 0)
+			lua_path = defGetString(def);
+
+		if (strcmp(def->defname, "lua_cpath") == 0)
+			lua_cpath = defGetString(def);
+	}
+
+	return lua_acquire(script, inject, lua_path, lua_cpath);
+}
+
+/*
+ * Get a Lua state for a foreign table's script options.
+ */
+static lua_State*
+lua_table_acquire (Oid foreigntableid)
+{
+	return lua_options_acquire(GetForeignTable(foreigntableid)->options);
+}
+
+Datum
+lua_fdw_handler (PG_FUNCTION_ARGS)
+{
+	FdwRoutine *fdwroutine = makeNode(FdwRoutine);
+
+	/*
+	 * assign the handlers for the FDW
+	 *
+	 * This function might be called a number of times. In particular, it is
+	 * likely to be called for each INSERT statement. For an explanation, see
+	 * core postgres file src/optimizer/plan/createplan.c where it calls
+	 * GetFdwRoutineByRelId(().
+	 */
+
+	/* Required by notations: S=SELECT I=INSERT U=UPDATE D=DELETE */
+
+	/* these are required */
+	fdwroutine->GetForeignRelSize = luaGetForeignRelSize; /* S U D */
+	fdwroutine->GetForeignPaths = luaGetForeignPaths;		/* S U D */
+	fdwroutine->GetForeignPlan = luaGetForeignPlan;		/* S U D */
+	fdwroutine->BeginForeignScan = luaBeginForeignScan;	/* S U D */
+	fdwroutine->IterateForeignScan = luaIterateForeignScan;		/* S */
+	fdwroutine->ReScanForeignScan = luaReScanForeignScan; /* S */
+	fdwroutine->EndForeignScan = luaEndForeignScan;		/* S U D */
+
+	/* remainder are optional - use NULL if not required */
+	/* support for insert / update / delete */
+	fdwroutine->IsForeignRelUpdatable = luaIsForeignRelUpdatable;
+	fdwroutine->AddForeignUpdateTargets = luaAddForeignUpdateTargets;		/* U D */
+	fdwroutine->PlanForeignModify = luaPlanForeignModify; /* I U D */
+	fdwroutine->BeginForeignModify = luaBeginForeignModify;		/* I U D */
+	fdwroutine->ExecForeignInsert = luaExecForeignInsert; /* I */
+	fdwroutine->ExecForeignUpdate = luaExecForeignUpdate; /* U */
+	fdwroutine->ExecForeignDelete = luaExecForeignDelete; /* D */
+	fdwroutine->EndForeignModify = luaEndForeignModify;	/* I U D */
+#if PG_VERSION_NUM >= 110000
+	fdwroutine->BeginForeignInsert = luaBeginForeignInsert; /* COPY, routing */
+	fdwroutine->EndForeignInsert = luaEndForeignInsert; /* COPY, routing */
+#endif
+#if PG_VERSION_NUM >= 140000
+	fdwroutine->ExecForeignBatchInsert = luaExecForeignBatchInsert; /* I */
+	fdwroutine->GetForeignModifyBatchSize = luaGetForeignModifyBatchSize; /* I */
+#endif
+
+	/* support for EXPLAIN */
+	fdwroutine->ExplainForeignScan = luaExplainForeignScan;		/* EXPLAIN S U D */
+	fdwroutine->ExplainForeignModify = luaExplainForeignModify;	/* EXPLAIN I U D */
+
+	/* support for ANALYSE */
+	fdwroutine->AnalyzeForeignTable = luaAnalyzeForeignTable;		/* ANALYZE only */
 
 	/* Support functions for IMPORT FOREIGN SCHEMA */
 	fdwroutine->ImportForeignSchema = luaImportForeignSchema;
 
+#if PG_VERSION_NUM >= 90600
+	/* support for parallel scans */
+	fdwroutine->IsForeignScanParallelSafe = luaIsForeignScanParallelSafe;
+	fdwroutine->EstimateDSMForeignScan = luaEstimateDSMForeignScan;
+	fdwroutine->InitializeDSMForeignScan = luaInitializeDSMForeignScan;
+	fdwroutine->InitializeWorkerForeignScan = luaInitializeWorkerForeignScan;
+#endif
+#if PG_VERSION_NUM >= 100000
+	fdwroutine->ReInitializeDSMForeignScan = luaReInitializeDSMForeignScan;
+#endif
+
+#if PG_VERSION_NUM >= 140000
+	/* support for asynchronous execution under Append */
+	fdwroutine->IsForeignPathAsyncCapable = luaIsForeignPathAsyncCapable;
+	fdwroutine->ForeignAsyncRequest = luaForeignAsyncRequest;
+	fdwroutine->ForeignAsyncConfigureWait = luaForeignAsyncConfigureWait;
+	fdwroutine->ForeignAsyncNotify = luaForeignAsyncNotify;
+#endif
+
 	/* Support for scanning foreign joins */
 	fdwroutine->GetForeignJoinPaths = luaGetForeignJoinPaths;
 
+#if PG_VERSION_NUM >= 100000
+	/* Support for aggregates */
+	fdwroutine->GetForeignUpperPaths = luaGetForeignUpperPaths;
+#endif
+
 	/* Support for locking foreign rows */
 	fdwroutine->GetForeignRowMarkType = luaGetForeignRowMarkType;
 	fdwroutine->RefetchForeignRow = luaRefetchForeignRow;
@@ -555,445 +1177,3582 @@ lua_fdw_validator (PG_FUNCTION_ARGS)
 				)
 			);
 		}
+
+		if (strcmp(def->defname, "fetch_size") == 0
+			|| strcmp(def->defname, "batch_size") == 0
+			|| strcmp(def->defname, "copy_batch_size") == 0)
+			(void) lua_option_int(def, 1);
+
+		if (strcmp(def->defname, "parallel") == 0
+			|| strcmp(def->defname, "async_capable") == 0
+			|| strcmp(def->defname, "prefetch") == 0)
+			(void) defGetBoolean(def);
+
+		if (strcmp(def->defname, "fdw_startup_cost") == 0 || strcmp(def->defname, "fdw_tuple_cost") == 0)
+			(void) lua_option_cost(def);
 	}
 
 	PG_RETURN_VOID();
 }
 
-static
-void lua_clauses(lua_State *lua, RelOptInfo *baserel, Oid foreigntableid)
+/*
+ * Recognise a join clause usable as a lookup key: an equality between a
+ * column of this rel and an expression over other rels only.
+ */
+static bool
+lua_param_clause (PlannerInfo *root, RestrictInfo *rinfo, Index relid, int *attno, Expr **outer)
 {
-	Relation rel;
-	TupleDesc desc;
-
-	ListCell *lc;
-	RestrictInfo *rinfo;
 	OpExpr *op;
-	Node *arg1, *arg2;
-	int i, attno, clause, swap;
-	int is_eq, is_ne, is_like, is_lt, is_gt, is_lte, is_gte;
-	Oid id;
-	char scratch[50];
+	Node *left, *right, *swap;
 
-	rel = heap_open(foreigntableid, AccessShareLock);
-	desc = RelationGetDescr(rel);
-
-	lua_getglobal(lua, "fdw");
+	if (!IsA(rinfo->clause, OpExpr) || rinfo->mergeopfamilies == NIL)
+		return false;
 
-	lua_pushstring(lua, "table");
-	lua_pushstring(lua, get_rel_name(foreigntableid));
-	lua_settable(lua, -3); // table
+	op = (OpExpr *) rinfo->clause;
 
-	lua_pushstring(lua, "columns");
-	lua_createtable(lua, 0, 0);
-	for (i = 0; i < desc->natts; i++)
-	{
-		lua_pushstring(lua, desc->attrs[i]->attname.data);
-		switch (desc->attrs[i]->atttypid)
-		{
-			case INT4OID:
-			case INT8OID:
-				lua_pushstring(lua, "integer");
-				break;
+	if (list_length(op->args) != 2)
+		return false;
 
-			case TIMESTAMPOID:
-				lua_pushstring(lua, "timestamp");
-				break;
+	left = linitial(op->args);
+	right = lsecond(op->args);
 
-			case TIMESTAMPTZOID:
-				lua_pushstring(lua, "timestamptz");
-				break;
+	if (IsA(right, RelabelType))
+		right = (Node *) ((RelabelType *) right)->arg;
 
-			default:
-				lua_pushstring(lua, "text");
-		}
-		lua_settable(lua, -3);
+	if (IsA(right, Var) && ((Var *) right)->varno == relid)
+	{
+		swap = left;
+		left = right;
+		right = swap;
 	}
-	lua_settable(lua, -3); // columns
 
-	lua_pushstring(lua, "clauses");
-	lua_createtable(lua, 0, 0);
-	clause = 1;
+	if (IsA(left, RelabelType))
+		left = (Node *) ((RelabelType *) left)->arg;
 
-	foreach(lc, baserel->baserestrictinfo)
-	{
-		rinfo = (RestrictInfo *) lfirst(lc);
-		Assert(IsA(rinfo, RestrictInfo));
+	if (!IsA(left, Var) || ((Var *) left)->varno != relid || ((Var *) left)->varlevelsup != 0 || ((Var *) left)->varattno <= 0)
+		return false;
 
-		if (rinfo->type == T_RestrictInfo && !rinfo->orclause && rinfo->clause->type == T_OpExpr)
-		{
-			op = (OpExpr*) rinfo->clause;
+#if PG_VERSION_NUM >= 140000
+	if (bms_is_member(relid, pull_varnos(root, right)))
+#else
+	if (bms_is_member(relid, pull_varnos(right)))
+#endif
+		return false;
 
-			if (list_length(op->args) == 2)
-			{
-				arg1 = list_nth(op->args, 0);
-				arg2 = list_nth(op->args, 1);
+	if (contain_volatile_functions(right))
+		return false;
 
-				swap = 0;
+	*attno = ((Var *) left)->varattno;
+	*outer = (Expr *) right;
+	return true;
+}
 
-				if (arg2->type == T_Var && arg1->type == T_Const)
-				{
-					arg1 = list_nth(op->args, 1);
-					arg2 = list_nth(op->args, 0);
-					swap = 1;
-				}
+typedef struct
+{
+	Expr *current;
+	List *already_used;
+} LuaFdwEcArg;
 
-				if (arg1->type == T_Var && arg2->type == T_Const)
-				{
-					id = ((Const*)arg2)->consttype;
-					attno = ((Var*)arg1)->varattno-1;
-
-					//elog(WARNING, "%d %d", id, op->opno);
-
-					is_like =
-						op->opno == OID_TEXT_LIKE_OP
-					;
-
-					is_eq =
-						op->opno == 15 // int48eq
-						|| op->opno == Int4EqualOperator
-						|| op->opno == TextEqualOperator
-						|| op->opno == 2060 // timestamp_eq
-						|| op->opno == 2386 // timestamptz_eq
-					;
-
-					is_ne =
-						op->opno == 36 // int48ne
-						|| op->opno == 518 // int4ne
-						|| op->opno == 531 // textne
-						|| op->opno == 2060 // timestamp_ne
-						|| op->opno == 1321 // timestamptz_ne
-					;
-
-					is_gt =
-						op->opno == 512 // int4gt
-						|| op->opno == 413 // int8gt
-						|| op->opno == 2064 // timestamp_gt
-						|| op->opno == 1324 // timestamptz_gt
-					;
-
-					is_gte =
-						op->opno == 525 // int4ge
-						|| op->opno == 415 // int8ge
-						|| op->opno == 2065 // timestamp_ge
-						|| op->opno == 1325 // timestamptz_ge
-					;
-
-					is_lt =
-						op->opno == Int4LessOperator
-						|| op->opno == Int8LessOperator
-						|| op->opno == 2062 // timestamp_lt
-						|| op->opno == 1322 // timestamptz_lt
-					;
-
-					is_lte =
-						op->opno == 523 // int4le
-						|| op->opno == 414 // int8le
-						|| op->opno == 2063 // timestamp_le
-						|| op->opno == 1323 // timestamptz_le
-					;
-
-					if (swap)
-					{
-						     if (is_lt) { is_lt = 0; is_gt = 1; }
-						else if (is_gt) { is_gt = 0; is_lt = 1; }
-						else if (is_lte) { is_lte = 0; is_gte = 1; }
-						else if (is_gte) { is_gte = 0; is_lte = 1; }
-
-						is_like = 0;
-					}
-
-					if ((is_eq || is_ne || is_like || is_lt || is_gt || is_lte || is_gte)
-						&& (id == TEXTOID || id == INT4OID || id == INT8OID || id == TIMESTAMPOID || id == TIMESTAMPTZOID))
-					{
-						lua_pushnumber(lua, clause++);
-						lua_createtable(lua, 0, 0);
-
-						lua_pushstring(lua, "column");
-						lua_pushstring(lua, desc->attrs[attno]->attname.data);
-						lua_settable(lua, -3);
-
-						lua_pushstring(lua, "operator");
-						lua_pushstring(lua,
-							is_like ? "like":
-							is_lt   ? "lt":
-							is_gt   ? "gt":
-							is_lte  ? "lte":
-							is_gte  ? "gte":
-							is_ne   ? "ne":
-							"eq"
-						);
-						lua_settable(lua, -3);
-
-						lua_pushstring(lua, "type");
-						switch (id)
-						{
-							case INT4OID:
-							case INT8OID:
-								lua_pushstring(lua, "integer");
-								break;
-
-							case TIMESTAMPOID:
-								lua_pushstring(lua, "timestamp");
-								break;
-
-							case TIMESTAMPTZOID:
-								lua_pushstring(lua, "timestamptz");
-								break;
-
-							default:
-								lua_pushstring(lua, "text");
-						}
-						lua_settable(lua, -3);
-
-						lua_pushstring(lua, "constant");
-						switch (id)
-						{
-							case INT4OID:
-								snprintf(scratch, sizeof(scratch), "%d", DatumGetInt32(((Const*)arg2)->constvalue));
-								lua_pushstring(lua, scratch);
-								break;
-
-							case INT8OID:
-								snprintf(scratch, sizeof(scratch), "%ld", DatumGetInt64(((Const*)arg2)->constvalue));
-								lua_pushstring(lua, scratch);
-								break;
-
-							case TIMESTAMPOID:
-								lua_pushstring(lua, DatumGetCString(DirectFunctionCall1(timestamp_out, ((Const*)arg2)->constvalue)));
-								break;
-
-							case TIMESTAMPTZOID:
-								lua_pushstring(lua, DatumGetCString(DirectFunctionCall1(timestamptz_out, ((Const*)arg2)->constvalue)));
-								break;
-
-							default:
-								lua_pushstring(lua, DatumGetCString(DirectFunctionCall1(textout, ((Const*)arg2)->constvalue)));
-						}
-						lua_settable(lua, -3);
-
-						lua_settable(lua, -3); // #clause
-					}
-				}
-			}
-		}
-	}
+/*
+ * Callback for generate_implied_equalities_for_column: pick one column of
+ * this rel per pass that hasn't been tried yet.
+ */
+static bool
+lua_ec_member_matches (PlannerInfo *root, RelOptInfo *rel, EquivalenceClass *ec, EquivalenceMember *em, void *arg)
+{
+	LuaFdwEcArg *state = (LuaFdwEcArg *) arg;
+	Expr *expr = em->em_expr;
 
-	lua_settable(lua, -3); // clauses
-	lua_pop(lua, 1); // fdw
+	if (state->current != NULL)
+		return equal(expr, state->current);
+
+	if (!IsA(expr, Var) || list_member(state->already_used, expr))
+		return false;
 
-	heap_close(rel, AccessShareLock);
+	state->current = expr;
+	return true;
 }
 
+/*
+ * Offer parameterized paths for nested loop key lookups, one per set of
+ * outer rels, costed by the script's EstimateParameterized(columns).
+ * Scripts without that callback get no parameterized paths, as they would
+ * rescan everything per outer row.
+ */
 static void
-luaGetForeignRelSize (PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+lua_param_paths (PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid, lua_State *lua)
 {
-	LuaFdwPlanState *plan_state;
-	ForeignTable *table;
-	ListCell *cell;
-	const char *script = NULL;
-	const char *inject = NULL;
-	const char *lua_path = NULL;
-	const char *lua_cpath = NULL;
-	lua_State *lua;
+	List *clauses = NIL;
+	List *outers = NIL;
+	ListCell *lc, *lc2;
+	LuaFdwEcArg arg;
+	Relation rel;
+	TupleDesc desc;
+	int attno, i;
+	Expr *outer;
+	bool seen;
 
-	/*
-	 * Obtain relation size estimates for a foreign table. This is called at
-	 * the beginning of planning for a query that scans a foreign table. root
-	 * is the planner's global information about the query; baserel is the
-	 * planner's information about this table; and foreigntableid is the
-	 * pg_class OID of the foreign table. (foreigntableid could be obtained
-	 * from the planner data structures, but it's passed explicitly to save
-	 * effort.)
-	 *
-	 * This function should update baserel->rows to be the expected number of
-	 * rows returned by the table scan, after accounting for the filtering
-	 * done by the restriction quals. The initial value of baserel->rows is
-	 * just a constant default estimate, which should be replaced if at all
-	 * possible. The function may also choose to update baserel->width if it
-	 * can compute a better estimate of the average result row width.
-	 */
-	//elog(WARNING, "%s", __func__);
+	lua_getglobal(lua, "EstimateParameterized");
+	seen = lua_isfunction(lua, -1);
+	lua_pop(lua, 1);
 
-	table = GetForeignTable(foreigntableid);
+	if (!seen)
+		return;
 
-	foreach(cell, table->options)
+	foreach(lc, baserel->joininfo)
 	{
-		DefElem *def = (DefElem *) lfirst(cell);
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
 
-		if (strcmp(def->defname, "script") == 0)
-			script = defGetString(def);
+		if (join_clause_is_movable_to(rinfo, baserel) && lua_param_clause(root, rinfo, baserel->relid, &attno, &outer))
+			clauses = lappend(clauses, rinfo);
+	}
 
-		if (strcmp(def->defname, "inject") == 0)
-			inject = defGetString(def);
+	/* equality joins are usually absorbed into equivalence classes */
+	if (baserel->has_eclass_joins)
+	{
+		memset(&arg, 0, sizeof(arg));
 
-		if (strcmp(def->defname, "lua_path") == 0)
-			lua_path = defGetString(def);
+		for (;;)
+		{
+			List *ec_clauses;
 
-		if (strcmp(def->defname, "lua_cpath") == 0)
-			lua_cpath = defGetString(def);
-	}
+			arg.current = NULL;
+			ec_clauses = generate_implied_equalities_for_column(root, baserel, lua_ec_member_matches, (void *) &arg, baserel->lateral_referencers);
 
-	plan_state = palloc0(sizeof(LuaFdwPlanState));
-	baserel->fdw_private = (void *) plan_state;
-	baserel->rows = 0;
+			if (arg.current == NULL)
+				break;
 
-	/* initialize required state in plan_state */
+			foreach(lc, ec_clauses)
+			{
+				RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
 
-	lua = plan_state->lua = lua_start(script, inject, lua_path, lua_cpath);
+				if (join_clause_is_movable_to(rinfo, baserel) && lua_param_clause(root, rinfo, baserel->relid, &attno, &outer))
+					clauses = lappend(clauses, rinfo);
+			}
+			arg.already_used = lappend(arg.already_used, arg.current);
+		}
+	}
 
-	lua_clauses(lua, baserel, foreigntableid);
+	rel = table_open(foreigntableid, AccessShareLock);
+	desc = RelationGetDescr(rel);
 
-	if (lua_callback(lua, "EstimateRowCount", 0, 1))
+	foreach(lc, clauses)
 	{
-		if (lua_isnumber(lua, -1))
-			baserel->rows = lua_tonumber(lua, -1);
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		Relids required_outer;
+		ParamPathInfo *param_info;
+		double rows;
+		Cost startup_cost, total_cost;
 
-		lua_pop(lua, 1);
-	}
+		required_outer = bms_union(bms_difference(rinfo->clause_relids, baserel->relids), baserel->lateral_relids);
 
-	if (lua_callback(lua, "EstimateRowWidth", 0, 1))
-	{
-		if (lua_isnumber(lua, -1))
+		if (bms_is_empty(required_outer))
+			continue;
+
+		seen = false;
+		foreach(lc2, outers)
 		{
-#if PG_VERSION_NUM < 90600
-			baserel->width = lua_tonumber(lua, -1);
-#else
-			baserel->reltarget->width = lua_tonumber(lua, -1);
-#endif
+			if (bms_equal((Relids) lfirst(lc2), required_outer))
+				seen = true;
 		}
 
-		lua_pop(lua, 1);
-	}
-}
+		if (seen)
+			continue;
 
-static void
-luaGetForeignPaths (PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
-{
-	LuaFdwPlanState *plan_state;
-	lua_State *lua;
-	Cost startup_cost, total_cost;
+		outers = lappend(outers, required_outer);
 
-	/*
-	 * Create possible access paths for a scan on a foreign table. This is
-	 * called during query planning. The parameters are the same as for
-	 * GetForeignRelSize, which has already been called.
-	 *
-	 * This function must generate at least one access path (ForeignPath node)
-	 * for a scan on the foreign table and must call add_path to add each such
-	 * path to baserel->pathlist. It's recommended to use
-	 * create_foreignscan_path to build the ForeignPath nodes. The function
-	 * can generate multiple access paths, e.g., a path which has valid
-	 * pathkeys to represent a pre-sorted result. Each access path must
-	 * contain cost estimates, and can contain any FDW-private information
-	 * that is needed to identify the specific scan method intended.
-	 */
-	//elog(WARNING, "%s", __func__);
+		param_info = get_baserel_parampathinfo(root, baserel, required_outer);
 
-	plan_state = baserel->fdw_private;
-	lua = plan_state->lua;
+		rows = param_info->ppi_rows;
+		startup_cost = 0;
+		total_cost = startup_cost + rows;
 
-	lua_clauses(lua, baserel, foreigntableid);
+		/* every column the lookup will bind */
+		lua_createtable(lua, 0, 0);
+		i = 1;
 
-	startup_cost = 0;
-	total_cost = startup_cost + baserel->rows;
+		foreach(lc2, param_info->ppi_clauses)
+		{
+			if (lua_param_clause(root, (RestrictInfo *) lfirst(lc2), baserel->relid, &attno, &outer))
+			{
+				lua_pushstring(lua, TupleDescAttr(desc, attno - 1)->attname.data);
+				lua_rawseti(lua, -2, i++);
+			}
+		}
 
-	if (lua_callback(lua, "EstimateStartupCost", 0, 1))
+		if (lua_callback(lua, "EstimateParameterized", 1, 3))
+		{
+			if (lua_isnumber(lua, -3))
+				rows = lua_tonumber(lua, -3);
+
+			if (lua_isnumber(lua, -2))
+				startup_cost = lua_tonumber(lua, -2);
+
+			if (lua_isnumber(lua, -1))
+				total_cost = lua_tonumber(lua, -1);
+
+			lua_pop(lua, 3);
+		}
+
+		add_path(baserel, (Path *)
+				 create_foreignscan_path(root, baserel,
+#if (PG_VERSION_NUM >= 90600)
+										 NULL,      /* default pathtarget */
+#endif
+										 rows,
+										 startup_cost,
+										 total_cost,
+										 NIL,		/* no pathkeys */
+										 required_outer,
+#if (PG_VERSION_NUM >= 90500)
+										 NULL,      /* no extra plan */
+#endif
+										 NIL));		/* no fdw_private data */
+	}
+
+	table_close(rel, AccessShareLock);
+}
+
+/*
+ * Attribute numbers the query needs from the scan: those in the target
+ * list plus those referenced by local quals. A whole-row reference needs
+ * everything.
+ */
+static List*
+lua_target_attrs (RelOptInfo *baserel, TupleDesc desc)
+{
+	Bitmapset *attrs_used = NULL;
+	List *attrs = NIL;
+	ListCell *lc;
+	int i;
+	bool whole_row;
+
+#if PG_VERSION_NUM >= 90600
+	pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid, &attrs_used);
+#else
+	pull_varattnos((Node *) baserel->reltargetlist, baserel->relid, &attrs_used);
+#endif
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		pull_varattnos((Node *) rinfo->clause, baserel->relid, &attrs_used);
+	}
+
+	whole_row = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs_used);
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		if (TupleDescAttr(desc, i)->attisdropped)
+			continue;
+
+		if (whole_row || bms_is_member(i + 1 - FirstLowInvalidHeapAttributeNumber, attrs_used))
+			attrs = lappend_int(attrs, i + 1);
+	}
+	return attrs;
+}
+
+/*
+ * Set fdw.target = { [column] = true, ... } on the table at the top of the
+ * stack.
+ */
+static void
+lua_target (lua_State *lua, TupleDesc desc, List *attrs)
+{
+	ListCell *lc;
+
+	lua_pushstring(lua, "target");
+	lua_createtable(lua, 0, list_length(attrs));
+
+	foreach(lc, attrs)
+	{
+		lua_pushstring(lua, TupleDescAttr(desc, lfirst_int(lc) - 1)->attname.data);
+		lua_pushboolean(lua, 1);
+		lua_settable(lua, -3);
+	}
+	lua_settable(lua, -3); // target
+}
+
+/*
+ * Push a Datum as the closest Lua type: numbers and booleans natively,
+ * anything else as the type's text output. output may be NULL to look the
+ * output function up.
+ */
+static void
+lua_push_datum (lua_State *lua, Datum value, bool isnull, Oid typid, FmgrInfo *output)
+{
+	Oid typoutput;
+	bool typisvarlena;
+
+	if (isnull)
+	{
+		lua_pushnil(lua);
+		return;
+	}
+
+	switch (typid)
+	{
+		case BOOLOID:
+			lua_pushboolean(lua, DatumGetBool(value));
+			return;
+
+		case INT2OID:
+			lua_pushinteger(lua, DatumGetInt16(value));
+			return;
+
+		case INT4OID:
+			lua_pushinteger(lua, DatumGetInt32(value));
+			return;
+
+		case INT8OID:
+#if LUA_VERSION_NUM >= 503
+			lua_pushinteger(lua, (lua_Integer) DatumGetInt64(value));
+#else
+			/* a double isn't exact beyond 2^53 */
+			lua_pushstring(lua, psprintf(INT64_FORMAT, DatumGetInt64(value)));
+#endif
+			return;
+
+		case FLOAT4OID:
+			lua_pushnumber(lua, DatumGetFloat4(value));
+			return;
+
+		case FLOAT8OID:
+			lua_pushnumber(lua, DatumGetFloat8(value));
+			return;
+	}
+
+	if (output)
+	{
+		lua_pushstring(lua, OutputFunctionCall(output, value));
+		return;
+	}
+
+	getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+	lua_pushstring(lua, OidOutputFunctionCall(typoutput, value));
+}
+
+/*
+ * The type name scripts see in fdw.columns and clauses.
+ */
+static const char*
+lua_type_name (Oid typid)
+{
+	switch (typid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			return "integer";
+
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return "number";
+
+		case BOOLOID:
+			return "boolean";
+
+		case DATEOID:
+			return "date";
+
+		case TIMESTAMPOID:
+			return "timestamp";
+
+		case TIMESTAMPTZOID:
+			return "timestamptz";
+
+		default:
+			return "text";
+	}
+}
+
+/*
+ * Set fdw.table and fdw.columns on the table at the top of the stack.
+ */
+static void
+lua_describe (lua_State *lua, Oid foreigntableid, TupleDesc desc)
+{
+	int i;
+
+	lua_pushstring(lua, "table");
+	lua_pushstring(lua, get_rel_name(foreigntableid));
+	lua_settable(lua, -3); // table
+
+	lua_pushstring(lua, "columns");
+	lua_createtable(lua, 0, 0);
+	for (i = 0; i < desc->natts; i++)
+	{
+		lua_pushstring(lua, TupleDescAttr(desc, i)->attname.data);
+		lua_pushstring(lua, lua_type_name(TupleDescAttr(desc, i)->atttypid));
+		lua_settable(lua, -3);
+	}
+	lua_settable(lua, -3); // columns
+}
+
+/*
+ * Whether a script comparing strings byte by byte agrees with PostgreSQL
+ * under a collation: always for the C collation and non-collatable types,
+ * and for equality under any deterministic collation.
+ */
+static bool
+lua_collation_ok (Oid collation, bool ordering)
+{
+	if (!OidIsValid(collation) || lc_collate_is_c(collation))
+		return true;
+
+	if (ordering)
+		return false;
+
+#if PG_VERSION_NUM >= 120000
+	return get_collation_isdeterministic(collation);
+#else
+	return true;
+#endif
+}
+
+/*
+ * Name a comparison the script can apply. Any operator the column type's
+ * default btree family knows, including cross-type ones such as int4 = int8,
+ * maps to its strategy, and an operator whose negator is the family's
+ * equality to "ne". swap means the constant is on the left.
+ */
+static const char*
+lua_clause_operator (Oid opno, Oid typid, bool swap)
+{
+	TypeCacheEntry *tce;
+	Oid negator;
+	int strategy;
+
+	if (opno == OID_TEXT_LIKE_OP)
+		return swap ? NULL : "like";
+
+	tce = lookup_type_cache(typid, TYPECACHE_BTREE_OPFAMILY);
+
+	if (!OidIsValid(tce->btree_opf))
+		return NULL;
+
+	strategy = get_op_opfamily_strategy(opno, tce->btree_opf);
+
+	if (strategy == 0)
+	{
+		negator = get_negator(opno);
+
+		if (OidIsValid(negator) && get_op_opfamily_strategy(negator, tce->btree_opf) == BTEqualStrategyNumber)
+			return "ne";
+
+		return NULL;
+	}
+
+	/* 'constant' < column is column > 'constant' */
+	if (swap)
+		strategy = BTMaxStrategyNumber + 1 - strategy;
+
+	switch (strategy)
+	{
+		case BTLessStrategyNumber:
+			return "lt";
+		case BTLessEqualStrategyNumber:
+			return "lte";
+		case BTEqualStrategyNumber:
+			return "eq";
+		case BTGreaterEqualStrategyNumber:
+			return "gte";
+		case BTGreaterStrategyNumber:
+			return "gt";
+	}
+	return NULL;
+}
+
+/*
+ * A plain column of the scanned table, looking through binary coercions
+ * such as varchar to text.
+ */
+static Var*
+lua_clause_var (Node *node)
+{
+	if (node && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+
+	if (node && IsA(node, Var) && ((Var *) node)->varattno > 0 && ((Var *) node)->varlevelsup == 0)
+		return (Var *) node;
+
+	return NULL;
+}
+
+/*
+ * Push the elements of an array constant as a Lua array, leaving out NULLs.
+ */
+static void
+lua_push_array (lua_State *lua, Const *array)
+{
+	ArrayType *arr = DatumGetArrayTypeP(array->constvalue);
+	Oid elemtype = ARR_ELEMTYPE(arr);
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	Datum *elems;
+	bool *nulls;
+	int i, n, j = 1;
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(arr, elemtype, typlen, typbyval, typalign, &elems, &nulls, &n);
+
+	lua_createtable(lua, n, 0);
+
+	for (i = 0; i < n; i++)
+	{
+		if (nulls[i])
+			continue;
+
+		lua_push_datum(lua, elems[i], false, elemtype, NULL);
+		lua_rawseti(lua, -2, j++);
+	}
+}
+
+/*
+ * Start a clause entry, leaving its table on the stack for the caller to
+ * add a constant to.
+ */
+static void
+lua_clause_begin (lua_State *lua, TupleDesc desc, Var *var, const char *operator)
+{
+	lua_createtable(lua, 0, 4);
+
+	lua_pushstring(lua, "column");
+	lua_pushstring(lua, TupleDescAttr(desc, var->varattno - 1)->attname.data);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "operator");
+	lua_pushstring(lua, operator);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "type");
+	lua_pushstring(lua, lua_type_name(TupleDescAttr(desc, var->varattno - 1)->atttypid));
+	lua_settable(lua, -3);
+}
+
+/*
+ * Push a clause entry for expr, returning false for shapes a script isn't
+ * offered: column (operator) constant, either way round; column = ANY or
+ * <> ALL of an array constant, ie IN and NOT IN lists; IS [NOT] NULL; and a
+ * bare boolean column. BETWEEN arrives as separate gte and lte clauses.
+ */
+static bool
+lua_clause (lua_State *lua, TupleDesc desc, Expr *expr)
+{
+	Node *arg1, *arg2;
+	Var *var;
+	Const *constant;
+	const char *operator;
+	bool swap = false;
+
+	if (IsA(expr, OpExpr) && list_length(((OpExpr *) expr)->args) == 2)
+	{
+		OpExpr *op = (OpExpr *) expr;
+
+		arg1 = linitial(op->args);
+		arg2 = lsecond(op->args);
+
+		if (IsA(arg1, Const))
+		{
+			arg1 = lsecond(op->args);
+			arg2 = linitial(op->args);
+			swap = true;
+		}
+
+		if (!(var = lua_clause_var(arg1)) || !IsA(arg2, Const) || ((Const *) arg2)->constisnull)
+			return false;
+
+		constant = (Const *) arg2;
+
+		if (!(operator = lua_clause_operator(op->opno, exprType(arg1), swap)))
+			return false;
+
+		/* eg text < 'b' in a linguistic collation */
+		if (!lua_collation_ok(op->inputcollid,
+				strcmp(operator, "eq") != 0 && strcmp(operator, "ne") != 0 && strcmp(operator, "like") != 0))
+			return false;
+
+		lua_clause_begin(lua, desc, var, operator);
+		lua_pushstring(lua, "constant");
+		lua_push_datum(lua, constant->constvalue, false, constant->consttype, NULL);
+		lua_settable(lua, -3);
+		return true;
+	}
+
+	if (IsA(expr, ScalarArrayOpExpr) && list_length(((ScalarArrayOpExpr *) expr)->args) == 2)
+	{
+		ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) expr;
+
+		arg1 = linitial(op->args);
+		arg2 = lsecond(op->args);
+
+		if (!(var = lua_clause_var(arg1)) || !IsA(arg2, Const) || ((Const *) arg2)->constisnull)
+			return false;
+
+		constant = (Const *) arg2;
+		operator = lua_clause_operator(op->opno, exprType(arg1), false);
+
+		if (operator && strcmp(operator, "eq") == 0 && op->useOr)
+			operator = "in";
+		else
+		/* a NULL in a NOT IN list means no row matches, leave that locally */
+		if (operator && strcmp(operator, "ne") == 0 && !op->useOr
+			&& !array_contains_nulls(DatumGetArrayTypeP(constant->constvalue)))
+			operator = "not_in";
+		else
+			return false;
+
+		if (!lua_collation_ok(op->inputcollid, false))
+			return false;
+
+		lua_clause_begin(lua, desc, var, operator);
+		lua_pushstring(lua, "constant");
+		lua_push_array(lua, constant);
+		lua_settable(lua, -3);
+		return true;
+	}
+
+	if (IsA(expr, NullTest) && !((NullTest *) expr)->argisrow)
+	{
+		NullTest *test = (NullTest *) expr;
+
+		if (!(var = lua_clause_var((Node *) test->arg)))
+			return false;
+
+		lua_clause_begin(lua, desc, var, test->nulltesttype == IS_NULL ? "is_null" : "is_not_null");
+		return true;
+	}
+
+	if ((var = lua_clause_var((Node *) expr)) && var->vartype == BOOLOID)
+	{
+		lua_clause_begin(lua, desc, var, "eq");
+		lua_pushstring(lua, "constant");
+		lua_pushboolean(lua, true);
+		lua_settable(lua, -3);
+		return true;
+	}
+
+	if (is_notclause(expr) && (var = lua_clause_var((Node *) get_notclausearg(expr))) && var->vartype == BOOLOID)
+	{
+		lua_clause_begin(lua, desc, var, "eq");
+		lua_pushstring(lua, "constant");
+		lua_pushboolean(lua, false);
+		lua_settable(lua, -3);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Functions fdw.quals may call. Only the built in, immutable versions are
+ * used, eg date_trunc on timestamp but not timestamptz.
+ */
+static const char *lua_qual_functions[] = {
+	"abs", "btrim", "ceil", "char_length", "date_part", "date_trunc",
+	"floor", "length", "lower", "ltrim", "round", "rtrim", "substr",
+	"substring", "trunc", "upper"
+};
+
+/*
+ * Whether an fdw.quals operator means the same to a script comparing strings
+ * byte by byte. = and <> do under a deterministic collation, anything else
+ * only in the C collation.
+ */
+static bool
+lua_qual_collation_ok (Oid opno, Oid collation)
+{
+	char *name = get_opname(opno);
+
+	return lua_collation_ok(collation, strcmp(name, "=") != 0 && strcmp(name, "<>") != 0);
+}
+
+/*
+ * Push expr as an fdw.quals tree node, returning false, with nothing pushed,
+ * if any part of it has no Lua equivalent. Nodes are tables with a kind:
+ *
+ *   and, or, not          args = { node, ... }
+ *   column                name, type
+ *   constant              value, type; value is an array for ANY/ALL
+ *   null                  a NULL constant
+ *   operator              operator = "=", "<", "~~", ...; args = { left, right }
+ *   any, all              operator, args = { left, array }
+ *   is_null, is_not_null  args = { node }
+ *   function              name, args
+ */
+static bool
+lua_qual (lua_State *lua, TupleDesc desc, Node *node)
+{
+	int top = lua_gettop(lua);
+	const char *kind = NULL;
+	List *args = NIL;
+	ListCell *lc;
+	Oid funcid;
+	int i;
+
+	if (node && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+
+	if (node == NULL)
+		return false;
+
+	lua_createtable(lua, 0, 3);
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+			{
+				Var *var = (Var *) node;
+
+				if (var->varattno <= 0 || var->varlevelsup != 0)
+					break;
+
+				lua_pushstring(lua, "kind");
+				lua_pushstring(lua, "column");
+				lua_settable(lua, -3);
+
+				lua_pushstring(lua, "name");
+				lua_pushstring(lua, TupleDescAttr(desc, var->varattno - 1)->attname.data);
+				lua_settable(lua, -3);
+
+				lua_pushstring(lua, "type");
+				lua_pushstring(lua, lua_type_name(TupleDescAttr(desc, var->varattno - 1)->atttypid));
+				lua_settable(lua, -3);
+				return true;
+			}
+
+		case T_Const:
+			{
+				Const *constant = (Const *) node;
+				Oid elemtype = get_element_type(constant->consttype);
+
+				lua_pushstring(lua, "kind");
+				lua_pushstring(lua, constant->constisnull ? "null" : "constant");
+				lua_settable(lua, -3);
+
+				if (constant->constisnull)
+					return true;
+
+				/* an array with NULLs doesn't mean the same without them */
+				if (OidIsValid(elemtype) && array_contains_nulls(DatumGetArrayTypeP(constant->constvalue)))
+					break;
+
+				lua_pushstring(lua, "type");
+				lua_pushstring(lua, lua_type_name(OidIsValid(elemtype) ? elemtype : constant->consttype));
+				lua_settable(lua, -3);
+
+				lua_pushstring(lua, "value");
+				if (OidIsValid(elemtype))
+					lua_push_array(lua, constant);
+				else
+					lua_push_datum(lua, constant->constvalue, false, constant->consttype, NULL);
+				lua_settable(lua, -3);
+				return true;
+			}
+
+		case T_BoolExpr:
+			{
+				BoolExpr *b = (BoolExpr *) node;
+
+				kind = b->boolop == AND_EXPR ? "and" : b->boolop == OR_EXPR ? "or" : "not";
+				args = b->args;
+				break;
+			}
+
+		case T_OpExpr:
+			{
+				OpExpr *op = (OpExpr *) node;
+
+				if (op->opno >= FirstNormalObjectId || op_volatile(op->opno) != PROVOLATILE_IMMUTABLE)
+					break;
+
+				if (!lua_qual_collation_ok(op->opno, op->inputcollid))
+					break;
+
+				kind = "operator";
+				args = op->args;
+
+				lua_pushstring(lua, "operator");
+				lua_pushstring(lua, get_opname(op->opno));
+				lua_settable(lua, -3);
+				break;
+			}
+
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) node;
+
+				if (op->opno >= FirstNormalObjectId || op_volatile(op->opno) != PROVOLATILE_IMMUTABLE)
+					break;
+
+				if (!lua_qual_collation_ok(op->opno, op->inputcollid))
+					break;
+
+				kind = op->useOr ? "any" : "all";
+				args = op->args;
+
+				lua_pushstring(lua, "operator");
+				lua_pushstring(lua, get_opname(op->opno));
+				lua_settable(lua, -3);
+				break;
+			}
+
+		case T_NullTest:
+			{
+				NullTest *test = (NullTest *) node;
+
+				if (test->argisrow)
+					break;
+
+				kind = test->nulltesttype == IS_NULL ? "is_null" : "is_not_null";
+				args = list_make1(test->arg);
+				break;
+			}
+
+		case T_FuncExpr:
+			{
+				funcid = ((FuncExpr *) node)->funcid;
+
+				if (funcid >= FirstNormalObjectId || func_volatile(funcid) != PROVOLATILE_IMMUTABLE)
+					break;
+
+				/* eg lower and upper follow the collation's case rules */
+				if (!lua_collation_ok(((FuncExpr *) node)->inputcollid, true))
+					break;
+
+				kind = get_func_name(funcid);
+
+				for (i = 0; i < lengthof(lua_qual_functions); i++)
+				{
+					if (strcmp(kind, lua_qual_functions[i]) == 0)
+						break;
+				}
+
+				if (i == lengthof(lua_qual_functions))
+					break;
+
+				lua_pushstring(lua, "name");
+				lua_pushstring(lua, kind);
+				lua_settable(lua, -3);
+
+				kind = "function";
+				args = ((FuncExpr *) node)->args;
+				break;
+			}
+
+		default:
+			break;
+	}
+
+	if (args == NIL)
+	{
+		lua_settop(lua, top);
+		return false;
+	}
+
+	lua_pushstring(lua, "kind");
+	lua_pushstring(lua, kind);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "args");
+	lua_createtable(lua, list_length(args), 0);
+	i = 1;
+
+	foreach(lc, args)
+	{
+		if (!lua_qual(lua, desc, (Node *) lfirst(lc)))
+		{
+			lua_settop(lua, top);
+			return false;
+		}
+		lua_rawseti(lua, -2, i++);
+	}
+	lua_settable(lua, -3); // args
+
+	return true;
+}
+
+/*
+ * Set fdw.clauses and fdw.quals on the table at the top of the stack.
+ * Clauses may be RestrictInfos at plan time or bare expressions from a
+ * plan's quals. Returns the members of clauses that made it into
+ * fdw.clauses, in the same order.
+ */
+static List*
+lua_clause_list (lua_State *lua, TupleDesc desc, List *clauses)
+{
+	List *pushed = NIL;
+	ListCell *lc;
+	Expr *expr;
+	int clause = 1;
+
+	lua_pushstring(lua, "clauses");
+	lua_createtable(lua, list_length(clauses), 0);
+
+	foreach(lc, clauses)
+	{
+		expr = (Expr *) lfirst(lc);
+
+		if (IsA(expr, RestrictInfo))
+			expr = ((RestrictInfo *) expr)->clause;
+
+		if (lua_clause(lua, desc, expr))
+		{
+			lua_rawseti(lua, -2, clause++);
+			pushed = lappend(pushed, lfirst(lc));
+		}
+	}
+
+	lua_settable(lua, -3); // clauses
+
+	lua_pushstring(lua, "quals");
+	lua_createtable(lua, list_length(clauses), 0);
+	clause = 1;
+
+	foreach(lc, clauses)
+	{
+		expr = (Expr *) lfirst(lc);
+
+		if (IsA(expr, RestrictInfo))
+			expr = ((RestrictInfo *) expr)->clause;
+
+		if (lua_qual(lua, desc, (Node *) expr))
+			lua_rawseti(lua, -2, clause++);
+	}
+
+	lua_settable(lua, -3); // quals
+
+	return pushed;
+}
+
+/*
+ * Describe a base rel's scan in fdw, returning the RestrictInfos behind
+ * fdw.clauses.
+ */
+static
+List* lua_clauses(lua_State *lua, RelOptInfo *baserel, Oid foreigntableid)
+{
+	Relation rel;
+	TupleDesc desc;
+	List *pushed;
+
+	rel = table_open(foreigntableid, AccessShareLock);
+	desc = RelationGetDescr(rel);
+
+	lua_getglobal(lua, "fdw");
+	lua_describe(lua, foreigntableid, desc);
+	lua_target(lua, desc, lua_target_attrs(baserel, desc));
+	pushed = lua_clause_list(lua, desc, baserel->baserestrictinfo);
+	lua_pop(lua, 1); // fdw
+
+	table_close(rel, AccessShareLock);
+
+	return pushed;
+}
+
+/*
+ * Ask PlanClauses(clauses) how the script applies each of fdw.clauses. It
+ * returns an array in the same order holding "exact", "lossy" or anything
+ * else for unsupported. Exact clauses are kept for luaGetForeignPlan to
+ * leave out of the local quals.
+ */
+static void
+lua_plan_clauses (RelOptInfo *baserel, List *pushed, lua_State *lua)
+{
+	LuaFdwPlanState *plan_state = baserel->fdw_private;
+	const char *mark;
+	ListCell *lc;
+	int i = 1;
+
+	lua_getglobal(lua, "fdw");
+	lua_pushstring(lua, "clauses");
+	lua_gettable(lua, -2);
+	lua_remove(lua, -2); // fdw
+
+	if (!lua_callback(lua, "PlanClauses", 1, 1))
+		return;
+
+	if (lua_istable(lua, -1))
+	{
+		foreach(lc, pushed)
+		{
+			lua_rawgeti(lua, -1, i++);
+			mark = lua_isstring(lua, -1) ? lua_tostring(lua, -1) : NULL;
+
+			if (mark && strcmp(mark, "exact") == 0)
+				plan_state->exact_clauses = lappend(plan_state->exact_clauses, lfirst(lc));
+
+			lua_pop(lua, 1);
+		}
+	}
+
+	lua_pop(lua, 1);
+}
+
+/*
+ * Estimate one entry of fdw.clauses (at index clause) from ColumnStats()
+ * (at index stats): { [column] = { n_distinct, null_frac, min, max } }.
+ * Negative n_distinct is a fraction of tuples, as in pg_stats. Returns -1
+ * when the statistics don't cover the clause.
+ */
+static double
+lua_stats_selectivity (lua_State *lua, int clause, int stats, double tuples)
+{
+	const char *operator;
+	double nd = 0, nf = 0, lo = 0, hi = 0, c = 0, frac, sel = -1;
+	bool range = false;
+	int n = 0;
+
+	lua_getfield(lua, clause, "column");
+	lua_gettable(lua, stats);
+
+	if (!lua_istable(lua, -1))
+	{
+		lua_pop(lua, 1);
+		return -1;
+	}
+
+	lua_getfield(lua, -1, "n_distinct");
+	if (lua_isnumber(lua, -1))
+		nd = lua_tonumber(lua, -1);
+	lua_getfield(lua, -2, "null_frac");
+	if (lua_isnumber(lua, -1))
+		nf = Min(Max(lua_tonumber(lua, -1), 0), 1);
+	lua_getfield(lua, -3, "min");
+	lua_getfield(lua, -4, "max");
+	lua_getfield(lua, clause, "constant");
+
+	if (lua_isnumber(lua, -3) && lua_isnumber(lua, -2) && lua_type(lua, -1) == LUA_TNUMBER)
+	{
+		lo = lua_tonumber(lua, -3);
+		hi = lua_tonumber(lua, -2);
+		c = lua_tonumber(lua, -1);
+		range = hi > lo;
+	}
+
+	if (lua_istable(lua, -1))
+		n = lua_rawlen(lua, -1);
+
+	lua_pop(lua, 6);
+
+	if (nd < 0)
+		nd = -nd * tuples;
+
+	lua_getfield(lua, clause, "operator");
+	operator = lua_tostring(lua, -1);
+
+	if (operator == NULL)
+		;
+	else
+	if (strcmp(operator, "is_null") == 0)
+		sel = nf;
+	else
+	if (strcmp(operator, "is_not_null") == 0)
+		sel = 1 - nf;
+	else
+	if (strcmp(operator, "eq") == 0 && nd >= 1)
+		sel = (1 - nf) / nd;
+	else
+	if (strcmp(operator, "ne") == 0 && nd >= 1)
+		sel = (1 - nf) * (1 - 1 / nd);
+	else
+	if (strcmp(operator, "in") == 0 && nd >= 1)
+		sel = (1 - nf) * Min(n / nd, 1);
+	else
+	if (strcmp(operator, "not_in") == 0 && nd >= 1)
+		sel = (1 - nf) * Max(1 - n / nd, 0);
+	else
+	if (range && (strcmp(operator, "lt") == 0 || strcmp(operator, "lte") == 0))
+	{
+		frac = (c - lo) / (hi - lo);
+		sel = (1 - nf) * Min(Max(frac, 0), 1);
+	}
+	else
+	if (range && (strcmp(operator, "gt") == 0 || strcmp(operator, "gte") == 0))
+	{
+		frac = (hi - c) / (hi - lo);
+		sel = (1 - nf) * Min(Max(frac, 0), 1);
+	}
+
+	lua_pop(lua, 1);
+	return sel;
+}
+
+/*
+ * Work out a selectivity hint for each of fdw.clauses, -1 where there is
+ * none. EstimateSelectivity(clauses) may return an array of fractions;
+ * otherwise ColumnStats() is used.
+ */
+static double*
+lua_selectivity_hints (lua_State *lua, List *pushed, double tuples)
+{
+	double *hints = palloc(sizeof(double) * (list_length(pushed) + 1));
+	int i, n = list_length(pushed);
+
+	for (i = 0; i < n; i++)
+		hints[i] = -1;
+
+	if (n == 0)
+		return hints;
+
+	lua_getglobal(lua, "fdw");
+	lua_getfield(lua, -1, "clauses");
+	lua_remove(lua, -2); // fdw
+
+	lua_pushvalue(lua, -1);
+	if (lua_callback(lua, "EstimateSelectivity", 1, 1))
+	{
+		if (lua_istable(lua, -1))
+		{
+			for (i = 0; i < n; i++)
+			{
+				lua_rawgeti(lua, -1, i + 1);
+				if (lua_isnumber(lua, -1))
+					hints[i] = Min(Max(lua_tonumber(lua, -1), 0), 1);
+				lua_pop(lua, 1);
+			}
+		}
+		lua_pop(lua, 1);
+	}
+
+	if (lua_callback(lua, "ColumnStats", 0, 1))
+	{
+		if (lua_istable(lua, -1))
+		{
+			for (i = 0; i < n; i++)
+			{
+				if (hints[i] >= 0)
+					continue;
+
+				lua_rawgeti(lua, -2, i + 1);
+				if (lua_istable(lua, -1))
+					hints[i] = lua_stats_selectivity(lua, lua_gettop(lua), lua_gettop(lua) - 1, tuples);
+				lua_pop(lua, 1);
+			}
+		}
+		lua_pop(lua, 1);
+	}
+
+	lua_pop(lua, 1); // clauses
+	return hints;
+}
+
+/*
+ * Selectivity of clauses, a subset of baserestrictinfo: the script's hints
+ * for clauses in fdw.clauses, times the planner's estimate for the rest,
+ * which uses ANALYZE statistics where there are any.
+ */
+static Selectivity
+lua_selectivity (PlannerInfo *root, RelOptInfo *baserel, List *clauses, List *pushed, double *hints)
+{
+	Selectivity sel = 1.0;
+	List *rest = NIL;
+	ListCell *lc, *lp;
+	int i;
+
+	foreach(lc, clauses)
+	{
+		i = 0;
+		foreach(lp, pushed)
+		{
+			if (lfirst(lp) == lfirst(lc) && hints[i] >= 0)
+				break;
+			i++;
+		}
+
+		if (lp)
+			sel *= hints[i];
+		else
+			rest = lappend(rest, lfirst(lc));
+	}
+
+	return sel * clauselist_selectivity(root, rest, baserel->relid, JOIN_INNER, NULL);
+}
+
+static char*
+lua_attname (Oid relid, AttrNumber attno)
+{
+#if PG_VERSION_NUM >= 110000
+	return get_attname(relid, attno, false);
+#else
+	return get_relid_attribute_name(relid, attno);
+#endif
+}
+
+/*
+ * True when two tables load the same script with the same options, so one
+ * Lua state can scan both.
+ */
+static bool
+lua_same_script (Oid a, Oid b)
+{
+	static const char *names[] = { "script", "inject", "lua_path", "lua_cpath" };
+	DefElem *da, *db;
+	int i;
+
+	for (i = 0; i < lengthof(names); i++)
+	{
+		da = lua_option(a, names[i]);
+		db = lua_option(b, names[i]);
+
+		if ((da == NULL) != (db == NULL))
+			return false;
+
+		if (da && strcmp(defGetString(da), defGetString(db)) != 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Recognise a join clause the script may use as a key: an equality between
+ * a column of each side.
+ */
+static bool
+lua_join_clause (RestrictInfo *rinfo, RelOptInfo *outerrel, RelOptInfo *innerrel, Var **outer, Var **inner)
+{
+	OpExpr *op;
+	Node *left, *right, *swap;
+
+	if (!IsA(rinfo->clause, OpExpr) || rinfo->mergeopfamilies == NIL)
+		return false;
+
+	op = (OpExpr *) rinfo->clause;
+
+	if (list_length(op->args) != 2)
+		return false;
+
+	left = linitial(op->args);
+	right = lsecond(op->args);
+
+	if (IsA(left, RelabelType))
+		left = (Node *) ((RelabelType *) left)->arg;
+
+	if (IsA(right, RelabelType))
+		right = (Node *) ((RelabelType *) right)->arg;
+
+	if (!IsA(left, Var) || !IsA(right, Var))
+		return false;
+
+	if (((Var *) left)->varno == innerrel->relid)
+	{
+		swap = left;
+		left = right;
+		right = swap;
+	}
+
+	if (((Var *) left)->varno != outerrel->relid || ((Var *) left)->varattno <= 0
+		|| ((Var *) right)->varno != innerrel->relid || ((Var *) right)->varattno <= 0)
+		return false;
+
+	*outer = (Var *) left;
+	*inner = (Var *) right;
+	return true;
+}
+
+/*
+ * Collect the columns a join scan must return: those needed above the join
+ * and those in quals checked locally. Fails on anything a script row can't
+ * supply, eg whole-row references, system columns or placeholders.
+ */
+static bool
+lua_join_vars (List *exprs, List *quals, List **vars)
+{
+	ListCell *lc;
+
+	*vars = list_concat(
+		pull_var_clause((Node *) exprs, PVC_INCLUDE_PLACEHOLDERS),
+		pull_var_clause((Node *) quals, PVC_INCLUDE_PLACEHOLDERS)
+	);
+
+	foreach(lc, *vars)
+	{
+		Var *var = (Var *) lfirst(lc);
+
+		if (!IsA(var, Var) || var->varattno <= 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Push a description of one side of a join for PlanJoin: its alias, plus
+ * table, columns, target and clauses as fdw has them for a plain scan.
+ */
+static void
+lua_join_side (lua_State *lua, PlannerInfo *root, RelOptInfo *rel)
+{
+	RangeTblEntry *rte = planner_rt_fetch(rel->relid, root);
+	Relation relation;
+	TupleDesc desc;
+
+	relation = table_open(rte->relid, AccessShareLock);
+	desc = RelationGetDescr(relation);
+
+	lua_createtable(lua, 0, 6);
+
+	lua_pushstring(lua, "alias");
+	lua_pushstring(lua, rte->eref->aliasname);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "rows");
+	lua_pushnumber(lua, rel->rows);
+	lua_settable(lua, -3);
+
+	lua_describe(lua, rte->relid, desc);
+	lua_target(lua, desc, lua_target_attrs(rel, desc));
+	lua_clause_list(lua, desc, rel->baserestrictinfo);
+
+	table_close(relation, AccessShareLock);
+}
+
+/*
+ * Build the ForeignScan for an accepted join. Output columns are named
+ * "alias.column" in fdw_scan_tlist, which is also how ScanIterate keys
+ * the joined rows.
+ */
+static ForeignScan*
+lua_join_plan (PlannerInfo *root, RelOptInfo *joinrel, List *tlist, Plan *outer_plan)
+{
+	LuaFdwPlanState *plan_state = joinrel->fdw_private;
+	RangeTblEntry *outer_rte = planner_rt_fetch(plan_state->outerrel->relid, root);
+	RangeTblEntry *inner_rte = planner_rt_fetch(plan_state->innerrel->relid, root);
+	List *private_state = NIL;
+	List *scan_tlist;
+	List *attrs = NIL;
+	ListCell *lc;
+	lua_State *inner_lua;
+
+	scan_tlist = add_to_flat_tlist(NIL, plan_state->join_vars);
+
+	foreach(lc, scan_tlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		Var *var = (Var *) tle->expr;
+		RangeTblEntry *rte = planner_rt_fetch(var->varno, root);
+
+		tle->resname = psprintf("%s.%s", rte->eref->aliasname, lua_attname(rte->relid, var->varattno));
+		attrs = lappend_int(attrs, tle->resno);
+	}
+
+	private_state = lappend(private_state, lua_table_options(outer_rte->relid));
+	private_state = lappend(private_state, attrs);
+	private_state = lappend(private_state, NIL);	/* no params */
+	private_state = lappend(private_state, NIL);	/* unordered */
+	private_state = lappend(private_state, makeInteger(0));	/* no limit */
+	private_state = lappend(private_state, list_make2_oid(outer_rte->relid, inner_rte->relid));
+	private_state = lappend(private_state, list_make2(makeString(pstrdup(outer_rte->eref->aliasname)), makeString(pstrdup(inner_rte->eref->aliasname))));
+	private_state = lappend(private_state, plan_state->join_clauses);
+
+	/*
+	 * The executor acquires its own. Neither member scan reaches
+	 * GetForeignPlan, so the inner table's state is returned here too.
+	 */
+	inner_lua = ((LuaFdwPlanState *) plan_state->innerrel->fdw_private)->lua;
+
+	if (inner_lua != plan_state->lua)
+		lua_release(inner_lua);
+
+	lua_release(plan_state->lua);
+
+	return make_foreignscan(
+		tlist,
+		plan_state->join_quals,
+		0,		/* no single relation */
+		NIL,	/* no expressions to evaluate */
+		private_state,	/* private state */
+		scan_tlist,	/* joined columns */
+		NIL,    /* no remote quals */
+		outer_plan
+	);
+}
+
+static void
+lua_join_rel (lua_State *lua, const char *key, Oid relid, const char *alias)
+{
+	lua_pushstring(lua, key);
+	lua_createtable(lua, 0, 2);
+
+	lua_pushstring(lua, "table");
+	lua_pushstring(lua, get_rel_name(relid));
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "alias");
+	lua_pushstring(lua, alias);
+	lua_settable(lua, -3);
+
+	lua_settable(lua, -3);
+}
+
+/*
+ * Set fdw.join on the table at the top of the stack, from a join plan's
+ * fdw_private.
+ */
+static void
+lua_join_describe (lua_State *lua, List *fdw_private)
+{
+	List *relids = (List *) list_nth(fdw_private, LuaFdwPrivateRelids);
+	List *aliases = (List *) list_nth(fdw_private, LuaFdwPrivateAliases);
+	List *clauses = (List *) list_nth(fdw_private, LuaFdwPrivateJoinClauses);
+	ListCell *lc;
+	int i = 1;
+
+	lua_pushstring(lua, "join");
+	lua_createtable(lua, 0, 4);
+
+	lua_pushstring(lua, "type");
+	lua_pushstring(lua, "inner");
+	lua_settable(lua, -3);
+
+	lua_join_rel(lua, "outer", linitial_oid(relids), strVal(linitial(aliases)));
+	lua_join_rel(lua, "inner", lsecond_oid(relids), strVal(lsecond(aliases)));
+
+	lua_pushstring(lua, "clauses");
+	lua_createtable(lua, list_length(clauses), 0);
+
+	foreach(lc, clauses)
+	{
+		List *clause = (List *) lfirst(lc);
+
+		lua_createtable(lua, 0, 3);
+
+		lua_pushstring(lua, "outer");
+		lua_pushstring(lua, strVal(linitial(clause)));
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "operator");
+		lua_pushstring(lua, strVal(lsecond(clause)));
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "inner");
+		lua_pushstring(lua, strVal(lthird(clause)));
+		lua_settable(lua, -3);
+
+		lua_rawseti(lua, -2, i++);
+	}
+	lua_settable(lua, -3); // clauses
+
+	lua_settable(lua, -3); // join
+}
+
+/*
+ * Push an array of strings.
+ */
+static void
+lua_string_list (lua_State *lua, List *strings)
+{
+	ListCell *lc;
+	int i = 1;
+
+	lua_createtable(lua, list_length(strings), 0);
+
+	foreach(lc, strings)
+	{
+		lua_pushstring(lua, strVal(lfirst(lc)));
+		lua_rawseti(lua, -2, i++);
+	}
+}
+
+/*
+ * Push aggregates as { { name, func, column }, ... }. column is absent for
+ * count(*).
+ */
+static void
+lua_aggregate_list (lua_State *lua, List *aggs)
+{
+	ListCell *lc;
+	int i = 1;
+
+	lua_createtable(lua, list_length(aggs), 0);
+
+	foreach(lc, aggs)
+	{
+		List *agg = (List *) lfirst(lc);
+
+		lua_createtable(lua, 0, 3);
+
+		lua_pushstring(lua, "name");
+		lua_pushstring(lua, strVal(linitial(agg)));
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "func");
+		lua_pushstring(lua, strVal(lsecond(agg)));
+		lua_settable(lua, -3);
+
+		if (strVal(lthird(agg))[0] != '\0')
+		{
+			lua_pushstring(lua, "column");
+			lua_pushstring(lua, strVal(lthird(agg)));
+			lua_settable(lua, -3);
+		}
+
+		lua_rawseti(lua, -2, i++);
+	}
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Recognise count(*), or count, sum, min, max or avg over a plain column
+ * of this rel. *column is NULL for count(*).
+ */
+static bool
+lua_aggregate_ok (Aggref *aggref, Index relid, Var **column)
+{
+	char *name;
+	Node *arg;
+
+	if (aggref->aggsplit != AGGSPLIT_SIMPLE
+		|| aggref->aggkind != AGGKIND_NORMAL
+		|| aggref->aggdistinct != NIL
+		|| aggref->aggorder != NIL
+		|| aggref->aggfilter != NULL
+		|| aggref->aggvariadic
+		|| get_func_namespace(aggref->aggfnoid) != PG_CATALOG_NAMESPACE)
+		return false;
+
+	name = get_func_name(aggref->aggfnoid);
+	*column = NULL;
+
+	if (aggref->aggstar)
+		return strcmp(name, "count") == 0;
+
+	if (strcmp(name, "count") != 0
+		&& strcmp(name, "sum") != 0
+		&& strcmp(name, "min") != 0
+		&& strcmp(name, "max") != 0
+		&& strcmp(name, "avg") != 0)
+		return false;
+
+	if (list_length(aggref->args) != 1)
+		return false;
+
+	/*
+	 * A Lua number can't hold a numeric result exactly, eg avg(integer) or
+	 * sum(bigint), so sum and avg are only offered for float and bigint.
+	 */
+	if ((strcmp(name, "sum") == 0 || strcmp(name, "avg") == 0)
+		&& aggref->aggtype != FLOAT4OID
+		&& aggref->aggtype != FLOAT8OID
+		&& aggref->aggtype != INT8OID)
+		return false;
+
+	arg = (Node *) ((TargetEntry *) linitial(aggref->args))->expr;
+
+	if (IsA(arg, RelabelType))
+		arg = (Node *) ((RelabelType *) arg)->arg;
+
+	if (!IsA(arg, Var) || ((Var *) arg)->varno != relid || ((Var *) arg)->varattno <= 0)
+		return false;
+
+	/* min and max compare values the way the script does */
+	if ((strcmp(name, "min") == 0 || strcmp(name, "max") == 0)
+		&& !lua_collation_ok(aggref->inputcollid, true))
+		return false;
+
+	*column = (Var *) arg;
+	return true;
+}
+
+/*
+ * Offer GROUP BY and aggregates over a plain table scan to the script's
+ * PlanAggregate(groups, aggs, clauses). Rows can't be rechecked once
+ * aggregated, so this needs every WHERE clause to appear in clauses, and a
+ * script that accepts must apply them all exactly.
+ */
+static void
+lua_aggregate_paths (PlannerInfo *root, RelOptInfo *input_rel, RelOptInfo *grouped_rel)
+{
+	Query *parse = root->parse;
+	PathTarget *target = root->upper_targets[UPPERREL_GROUP_AGG];
+	LuaFdwPlanState *plan_state;
+	RangeTblEntry *rte;
+	lua_State *lua;
+	List *group_vars = NIL;
+	List *aggrefs = NIL;
+	List *groups = NIL;
+	List *aggs = NIL;
+	List *scan_tlist = NIL;
+	ListCell *lc, *lc2;
+	Relation rel;
+	Var *column;
+	double rows;
+	Cost startup_cost, total_cost;
+	bool defined;
+	int i;
+
+	plan_state = palloc0(sizeof(LuaFdwPlanState));
+	grouped_rel->fdw_private = plan_state;
+
+	if (input_rel->reloptkind != RELOPT_BASEREL
+		|| parse->groupingSets != NIL
+		|| parse->havingQual != NULL
+		|| parse->hasTargetSRFs)
+		return;
+
+	lua = ((LuaFdwPlanState *) input_rel->fdw_private)->lua;
+
+	lua_getglobal(lua, "PlanAggregate");
+	defined = lua_isfunction(lua, -1);
+	lua_pop(lua, 1);
+
+	if (!defined)
+		return;
+
+	foreach(lc, input_rel->baserestrictinfo)
+	{
+		if (((RestrictInfo *) lfirst(lc))->pseudoconstant)
+			return;
+	}
+
+	/* GROUP BY must be plain columns */
+	i = 0;
+	foreach(lc, target->exprs)
+	{
+		Expr *expr = (Expr *) lfirst(lc);
+		Index sgref = get_pathtarget_sortgroupref(target, i++);
+
+		if (!sgref || !get_sortgroupref_clause_noerr(sgref, parse->groupClause))
+			continue;
+
+		if (!IsA(expr, Var) || ((Var *) expr)->varno != input_rel->relid || ((Var *) expr)->varattno <= 0)
+			return;
+
+		/* the script decides which strings fall in the same group */
+		if (!lua_collation_ok(exprCollation((Node *) expr), false))
+			return;
+
+		group_vars = list_append_unique(group_vars, expr);
+	}
+
+	/* everything else must be computable from those and the aggregates */
+	i = 0;
+	foreach(lc, target->exprs)
+	{
+		Expr *expr = (Expr *) lfirst(lc);
+		Index sgref = get_pathtarget_sortgroupref(target, i++);
+
+		if (sgref && get_sortgroupref_clause_noerr(sgref, parse->groupClause))
+			continue;
+
+		foreach(lc2, pull_var_clause((Node *) expr, PVC_INCLUDE_AGGREGATES | PVC_INCLUDE_PLACEHOLDERS))
+		{
+			Node *node = (Node *) lfirst(lc2);
+
+			if (IsA(node, Aggref) && lua_aggregate_ok((Aggref *) node, input_rel->relid, &column))
+				aggrefs = list_append_unique(aggrefs, node);
+			else
+			if (!list_member(group_vars, node))
+				return;
+		}
+	}
+
+	rte = planner_rt_fetch(input_rel->relid, root);
+
+	/* result rows are keyed by column name, and "func(column)" */
+	foreach(lc, group_vars)
+	{
+		Var *var = (Var *) lfirst(lc);
+		char *name = lua_attname(rte->relid, var->varattno);
+
+		groups = lappend(groups, makeString(name));
+		scan_tlist = lappend(scan_tlist, makeTargetEntry((Expr *) var, list_length(scan_tlist) + 1, name, false));
+	}
+
+	foreach(lc, aggrefs)
+	{
+		Aggref *aggref = (Aggref *) lfirst(lc);
+		char *func = get_func_name(aggref->aggfnoid);
+		char *name;
+
+		(void) lua_aggregate_ok(aggref, input_rel->relid, &column);
+
+		name = column
+			? psprintf("%s(%s)", func, lua_attname(rte->relid, column->varattno))
+			: psprintf("%s(*)", func);
+
+		aggs = lappend(aggs, list_make3(makeString(name), makeString(func),
+			makeString(column ? lua_attname(rte->relid, column->varattno) : pstrdup(""))));
+		scan_tlist = lappend(scan_tlist, makeTargetEntry((Expr *) aggref, list_length(scan_tlist) + 1, name, false));
+	}
+
+	if (scan_tlist == NIL)
+		return;
+
+	lua_clauses(lua, input_rel, rte->relid);
+
+	/* PlanAggregate(groups, aggs, clauses) */
+	lua_string_list(lua, groups);
+	lua_aggregate_list(lua, aggs);
+
+	rel = table_open(rte->relid, AccessShareLock);
+	lua_createtable(lua, 0, 1);
+	lua_clause_list(lua, RelationGetDescr(rel), input_rel->baserestrictinfo);
+	lua_getfield(lua, -1, "clauses");
+	lua_remove(lua, -2);
+	table_close(rel, AccessShareLock);
+
+	if ((int) lua_rawlen(lua, -1) < list_length(input_rel->baserestrictinfo))
+	{
+		lua_pop(lua, 3);
+		return;
+	}
+
+	if (group_vars == NIL)
+		rows = 1;
+	else
+#if PG_VERSION_NUM >= 140000
+		rows = estimate_num_groups(root, group_vars, input_rel->rows, NULL, NULL);
+#else
+		rows = estimate_num_groups(root, group_vars, input_rel->rows, NULL);
+#endif
+
+	startup_cost = 0;
+	total_cost = startup_cost + rows;
+
+	if (!lua_callback(lua, "PlanAggregate", 3, 4))
+		return;
+
+	if (!lua_toboolean(lua, -4))
+	{
+		lua_pop(lua, 4);
+		return;
+	}
+
+	if (lua_isnumber(lua, -3))
+		rows = lua_tonumber(lua, -3);
+
+	if (lua_isnumber(lua, -2))
+		startup_cost = lua_tonumber(lua, -2);
+
+	if (lua_isnumber(lua, -1))
+		total_cost = lua_tonumber(lua, -1);
+
+	lua_pop(lua, 4);
+
+	plan_state->lua = lua;
+	plan_state->scan_tlist = scan_tlist;
+	plan_state->upper_private = list_make4(
+		list_make1_oid(rte->relid),
+		groups,
+		aggs,
+		extract_actual_clauses(input_rel->baserestrictinfo, false)
+	);
+
+	add_path(grouped_rel, (Path *)
+#if PG_VERSION_NUM >= 120000
+			 create_foreign_upper_path(root, grouped_rel,
+									 target,
+									 rows,
+									 startup_cost,
+									 total_cost,
+									 NIL,		/* no pathkeys */
+									 NULL,      /* no extra plan */
+									 NIL));		/* no fdw_private data */
+#else
+			 create_foreignscan_path(root, grouped_rel,
+									 target,
+									 rows,
+									 startup_cost,
+									 total_cost,
+									 NIL,		/* no pathkeys */
+									 NULL,		/* no outer rel either */
+									 NULL,      /* no extra plan */
+									 NIL));		/* no fdw_private data */
+#endif
+}
+
+/*
+ * Note how many rows a LIMIT needs from the only table in the query, when
+ * nothing between the scan and the Limit node can filter or multiply rows.
+ * No path is added: the Limit stays in the plan, and luaGetForeignPlan
+ * passes the count on to the scan as fdw.limit.
+ */
+static void
+lua_limit_paths (PlannerInfo *root)
+{
+	Query *parse = root->parse;
+	RelOptInfo *baserel;
+	ListCell *lc;
+	int relid;
+	int64 count, offset = 0;
+
+	if (parse->commandType != CMD_SELECT
+		|| root->rowMarks != NIL
+		|| parse->setOperations != NULL
+		|| parse->groupClause != NIL
+		|| parse->groupingSets != NIL
+		|| parse->hasAggs
+		|| parse->havingQual != NULL
+		|| parse->hasWindowFuncs
+		|| parse->distinctClause != NIL
+		|| parse->hasTargetSRFs)
+		return;
+
+#if PG_VERSION_NUM >= 130000
+	if (parse->limitOption == LIMIT_OPTION_WITH_TIES)
+		return;
+#endif
+
+	if (parse->limitCount == NULL || !IsA(parse->limitCount, Const) || ((Const *) parse->limitCount)->constisnull)
+		return;
+
+	if (parse->limitOffset != NULL && !IsA(parse->limitOffset, Const))
+		return;
+
+	count = DatumGetInt64(((Const *) parse->limitCount)->constvalue);
+
+	if (parse->limitOffset != NULL && !((Const *) parse->limitOffset)->constisnull)
+		offset = DatumGetInt64(((Const *) parse->limitOffset)->constvalue);
+
+	if (count <= 0 || offset < 0 || count + offset > INT_MAX)
+		return;
+
+	if (!bms_get_singleton_member(root->all_baserels, &relid))
+		return;
+
+	baserel = find_base_rel(root, relid);
+
+	/* rows dropped by local quals would leave the LIMIT short */
+	if (baserel->reloptkind != RELOPT_BASEREL
+		|| planner_rt_fetch(relid, root)->relkind != RELKIND_FOREIGN_TABLE
+		|| baserel->fdw_private == NULL)
+		return;
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		if (!list_member_ptr(((LuaFdwPlanState *) baserel->fdw_private)->exact_clauses, lfirst(lc)))
+			return;
+	}
+
+	((LuaFdwPlanState *) baserel->fdw_private)->limit = count + offset;
+}
+
+/*
+ * Build the ForeignScan for an accepted aggregate, returning one row per
+ * group.
+ */
+static ForeignScan*
+lua_upper_plan (RelOptInfo *upperrel, List *tlist, Plan *outer_plan)
+{
+	LuaFdwPlanState *plan_state = upperrel->fdw_private;
+	List *private_state = NIL;
+	List *attrs = NIL;
+	ListCell *lc;
+
+	foreach(lc, plan_state->scan_tlist)
+		attrs = lappend_int(attrs, ((TargetEntry *) lfirst(lc))->resno);
+
+	private_state = lappend(private_state, lua_table_options(linitial_oid((List *) linitial(plan_state->upper_private))));
+	private_state = lappend(private_state, attrs);
+	private_state = lappend(private_state, NIL);	/* no params */
+	private_state = lappend(private_state, NIL);	/* unordered */
+	private_state = lappend(private_state, makeInteger(0));	/* no limit */
+	private_state = list_concat(private_state, list_copy(plan_state->upper_private));
+
+	/* the executor acquires its own */
+	lua_release(plan_state->lua);
+
+	return make_foreignscan(
+		tlist,
+		NIL,	/* nothing to check locally */
+		0,		/* no single relation */
+		NIL,	/* no expressions to evaluate */
+		private_state,	/* private state */
+		plan_state->scan_tlist,	/* groups and aggregates */
+		NIL,    /* no remote quals */
+		outer_plan
+	);
+}
+#endif
+
+/*
+ * Set fdw.table, fdw.columns and fdw.clauses for the table being
+ * aggregated, and fdw.aggregate, from an aggregate plan's fdw_private.
+ */
+static void
+lua_aggregate_describe (lua_State *lua, List *fdw_private)
+{
+	Oid relid = linitial_oid((List *) list_nth(fdw_private, LuaFdwPrivateRelids));
+	Relation rel;
+
+	rel = table_open(relid, AccessShareLock);
+	lua_describe(lua, relid, RelationGetDescr(rel));
+	lua_clause_list(lua, RelationGetDescr(rel), (List *) list_nth(fdw_private, LuaFdwPrivateQuals));
+	table_close(rel, AccessShareLock);
+
+	lua_pushstring(lua, "aggregate");
+	lua_createtable(lua, 0, 2);
+
+	lua_pushstring(lua, "groups");
+	lua_string_list(lua, (List *) list_nth(fdw_private, LuaFdwPrivateGroups));
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "aggs");
+	lua_aggregate_list(lua, (List *) list_nth(fdw_private, LuaFdwPrivateAggs));
+	lua_settable(lua, -3);
+
+	lua_settable(lua, -3); // aggregate
+}
+
+/*
+ * The column of this rel a pathkey sorts by, or NULL.
+ */
+static Var*
+lua_pathkey_column (PathKey *pathkey, RelOptInfo *baserel)
+{
+	EquivalenceClass *ec = pathkey->pk_eclass;
+	ListCell *lc;
+
+	if (ec->ec_has_volatile)
+		return NULL;
+
+	foreach(lc, ec->ec_members)
+	{
+		EquivalenceMember *em = (EquivalenceMember *) lfirst(lc);
+		Expr *expr = em->em_expr;
+
+		if (IsA(expr, RelabelType))
+			expr = ((RelabelType *) expr)->arg;
+
+		if (bms_equal(em->em_relids, baserel->relids) && IsA(expr, Var) && ((Var *) expr)->varattno > 0)
+			return (Var *) expr;
+	}
+	return NULL;
+}
+
+/*
+ * Describe pathkeys as [column, direction, nulls] entries, or NIL if any
+ * isn't a plain column of this rel, sorted by its type's default ordering
+ * and, for text and the like, in the C collation. Scripts only get orders
+ * they can reproduce with plain comparisons.
+ */
+static List*
+lua_order_by (List *pathkeys, RelOptInfo *baserel, Oid foreigntableid)
+{
+	List *order_by = NIL;
+	ListCell *lc;
+
+	foreach(lc, pathkeys)
+	{
+		PathKey *pathkey = (PathKey *) lfirst(lc);
+		Var *var = lua_pathkey_column(pathkey, baserel);
+
+		if (var == NULL)
+			return NIL;
+
+		if (pathkey->pk_opfamily != lookup_type_cache(var->vartype, TYPECACHE_BTREE_OPFAMILY)->btree_opf
+			|| !lua_collation_ok(pathkey->pk_eclass->ec_collation, true))
+			return NIL;
+
+		order_by = lappend(order_by, list_make3(
+			makeString(lua_attname(foreigntableid, var->varattno)),
+			makeString(pstrdup(pathkey->pk_strategy == BTLessStrategyNumber ? "asc" : "desc")),
+			makeString(pstrdup(pathkey->pk_nulls_first ? "first" : "last"))
+		));
+	}
+	return order_by;
+}
+
+/*
+ * Push an ordering as { { column, direction, nulls }, ... }.
+ */
+static void
+lua_order_list (lua_State *lua, List *order_by)
+{
+	ListCell *lc;
+	int i = 1;
+
+	lua_createtable(lua, list_length(order_by), 0);
+
+	foreach(lc, order_by)
+	{
+		List *key = (List *) lfirst(lc);
+
+		lua_createtable(lua, 0, 3);
+
+		lua_pushstring(lua, "column");
+		lua_pushstring(lua, strVal(linitial(key)));
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "direction");
+		lua_pushstring(lua, strVal(lsecond(key)));
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "nulls");
+		lua_pushstring(lua, strVal(lthird(key)));
+		lua_settable(lua, -3);
+
+		lua_rawseti(lua, -2, i++);
+	}
+}
+
+/*
+ * Offer presorted paths for the query's ORDER BY and for merge joins, for
+ * each ordering the script says it can produce. The ordering travels in
+ * the path's fdw_private to fdw.order_by.
+ */
+static void
+lua_sorted_paths (PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid, lua_State *lua)
+{
+	List *candidates = NIL;
+	ListCell *lc, *lc2;
+	bool defined;
+
+	lua_getglobal(lua, "EstimateSortedPaths");
+	defined = lua_isfunction(lua, -1);
+	lua_pop(lua, 1);
+
+	if (!defined)
+		return;
+
+	if (root->query_pathkeys != NIL && lua_order_by(root->query_pathkeys, baserel, foreigntableid) != NIL)
+		candidates = lappend(candidates, root->query_pathkeys);
+
+	/* single column orderings useful to a merge join */
+	if (baserel->has_eclass_joins)
+	{
+		foreach(lc, root->eq_classes)
+		{
+			EquivalenceClass *ec = (EquivalenceClass *) lfirst(lc);
+			List *pathkeys;
+			bool seen = false;
+
+			if (!eclass_useful_for_merging(root, ec, baserel))
+				continue;
+
+			pathkeys = list_make1(make_canonical_pathkey(root, ec, linitial_oid(ec->ec_opfamilies), BTLessStrategyNumber, false));
+
+			foreach(lc2, candidates)
+			{
+				if (compare_pathkeys(pathkeys, (List *) lfirst(lc2)) == PATHKEYS_EQUAL)
+					seen = true;
+			}
+
+			if (!seen && lua_order_by(pathkeys, baserel, foreigntableid) != NIL)
+				candidates = lappend(candidates, pathkeys);
+		}
+	}
+
+	foreach(lc, candidates)
+	{
+		List *pathkeys = (List *) lfirst(lc);
+		List *order_by = lua_order_by(pathkeys, baserel, foreigntableid);
+		Cost startup_cost, total_cost;
+
+		/* startup and total cost, or nil if the script can't sort this way */
+		lua_order_list(lua, order_by);
+
+		if (!lua_callback(lua, "EstimateSortedPaths", 1, 2))
+			continue;
+
+		if (!lua_isnumber(lua, -2) || !lua_isnumber(lua, -1))
+		{
+			lua_pop(lua, 2);
+			continue;
+		}
+
+		startup_cost = lua_tonumber(lua, -2);
+		total_cost = lua_tonumber(lua, -1);
+		lua_pop(lua, 2);
+
+		add_path(baserel, (Path *)
+				 create_foreignscan_path(root, baserel,
+#if (PG_VERSION_NUM >= 90600)
+										 NULL,      /* default pathtarget */
+#endif
+										 baserel->rows,
+										 startup_cost,
+										 total_cost,
+										 pathkeys,
+										 NULL,		/* no outer rel either */
+#if (PG_VERSION_NUM >= 90500)
+										 NULL,      /* no extra plan */
+#endif
+										 order_by));
+	}
+}
+
+static void
+luaGetForeignRelSize (PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+	LuaFdwPlanState *plan_state;
+	lua_State *lua;
+	DefElem *def;
+	List *pushed;
+	double tuples;
+	double *hints;
+
+	/*
+	 * Obtain relation size estimates for a foreign table. This is called at
+	 * the beginning of planning for a query that scans a foreign table. root
+	 * is the planner's global information about the query; baserel is the
+	 * planner's information about this table; and foreigntableid is the
+	 * pg_class OID of the foreign table. (foreigntableid could be obtained
+	 * from the planner data structures, but it's passed explicitly to save
+	 * effort.)
+	 *
+	 * This function should update baserel->rows to be the expected number of
+	 * rows returned by the table scan, after accounting for the filtering
+	 * done by the restriction quals. The initial value of baserel->rows is
+	 * just a constant default estimate, which should be replaced if at all
+	 * possible. The function may also choose to update baserel->width if it
+	 * can compute a better estimate of the average result row width.
+	 */
+	//elog(WARNING, "%s", __func__);
+
+	plan_state = palloc0(sizeof(LuaFdwPlanState));
+	baserel->fdw_private = (void *) plan_state;
+	baserel->rows = 0;
+
+	/* initialize required state in plan_state */
+
+	lua = plan_state->lua = lua_table_acquire(foreigntableid);
+
+	def = lua_option(foreigntableid, "async_capable");
+	plan_state->async_capable = def && defGetBoolean(def);
+
+	pushed = lua_clauses(lua, baserel, foreigntableid);
+	lua_plan_clauses(baserel, pushed, lua);
+
+	/*
+	 * EstimateRowCount() is the size of the whole table. Without it, use
+	 * the row count from the last ANALYZE, or a guess.
+	 */
+	tuples = baserel->tuples > 0 ? baserel->tuples : 1000;
+
+	if (lua_callback(lua, "EstimateRowCount", 0, 1))
+	{
+		if (lua_isnumber(lua, -1))
+			tuples = lua_tonumber(lua, -1);
+
+		lua_pop(lua, 1);
+	}
+
+	baserel->tuples = tuples;
+	hints = lua_selectivity_hints(lua, pushed, tuples);
+
+	/* the scan returns rows matching every clause, however applied */
+	baserel->rows = clamp_row_est(tuples * lua_selectivity(root, baserel, baserel->baserestrictinfo, pushed, hints));
+
+	/* the script itself only returns rows matching its exact clauses */
+	plan_state->fetched_rows = clamp_row_est(tuples * lua_selectivity(root, baserel, plan_state->exact_clauses, pushed, hints));
+
+	if (lua_callback(lua, "EstimateRowWidth", 0, 1))
+	{
+		if (lua_isnumber(lua, -1))
+		{
+#if PG_VERSION_NUM < 90600
+			baserel->width = lua_tonumber(lua, -1);
+#else
+			baserel->reltarget->width = lua_tonumber(lua, -1);
+#endif
+		}
+
+		lua_pop(lua, 1);
+	}
+}
+
+static void
+luaGetForeignPaths (PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+	LuaFdwPlanState *plan_state;
+	lua_State *lua;
+	Cost startup_cost, total_cost;
+	QualCost qual_cost;
+	List *local = NIL;
+	ListCell *lc;
+
+	/*
+	 * Create possible access paths for a scan on a foreign table. This is
+	 * called during query planning. The parameters are the same as for
+	 * GetForeignRelSize, which has already been called.
+	 *
+	 * This function must generate at least one access path (ForeignPath node)
+	 * for a scan on the foreign table and must call add_path to add each such
+	 * path to baserel->pathlist. It's recommended to use
+	 * create_foreignscan_path to build the ForeignPath nodes. The function
+	 * can generate multiple access paths, e.g., a path which has valid
+	 * pathkeys to represent a pre-sorted result. Each access path must
+	 * contain cost estimates, and can contain any FDW-private information
+	 * that is needed to identify the specific scan method intended.
+	 */
+	//elog(WARNING, "%s", __func__);
+
+	plan_state = baserel->fdw_private;
+	lua = plan_state->lua;
+
+	lua_clauses(lua, baserel, foreigntableid);
+
+	/*
+	 * Without cost callbacks, charge fdw_startup_cost once, fdw_tuple_cost
+	 * for each row the script returns, and the usual CPU cost of checking
+	 * the clauses it doesn't apply exactly.
+	 */
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		if (!list_member_ptr(plan_state->exact_clauses, lfirst(lc)))
+			local = lappend(local, lfirst(lc));
+	}
+
+	cost_qual_eval(&qual_cost, local, root);
+
+	startup_cost = lua_cost(foreigntableid, "fdw_startup_cost", 0) + qual_cost.startup;
+	total_cost = startup_cost + plan_state->fetched_rows * (lua_cost(foreigntableid, "fdw_tuple_cost", 1) + qual_cost.per_tuple);
+
+	if (lua_callback(lua, "EstimateStartupCost", 0, 1))
+	{
+		if (lua_isnumber(lua, -1))
+			startup_cost = lua_tonumber(lua, -1);
+
+		lua_pop(lua, 1);
+	}
+
+	if (lua_callback(lua, "EstimateTotalCost", 0, 1))
+	{
+		if (lua_isnumber(lua, -1))
+			total_cost = lua_tonumber(lua, -1);
+
+		lua_pop(lua, 1);
+	}
+
+	/* Create a ForeignPath node and add it as only possible path */
+	add_path(baserel, (Path *)
+			 create_foreignscan_path(root, baserel,
+#if (PG_VERSION_NUM >= 90600)
+									 NULL,      /* default pathtarget */
+#endif
+									 baserel->rows,
+									 startup_cost,
+									 total_cost,
+									 NIL,		/* no pathkeys */
+									 NULL,		/* no outer rel either */
+#if (PG_VERSION_NUM >= 90500)
+									 NULL,      /* no extra plan */
+#endif
+									 NIL));		/* no fdw_private data */
+
+	lua_sorted_paths(root, baserel, foreigntableid, lua);
+
+#if PG_VERSION_NUM >= 90600
+	/*
+	 * Parallel-aware path, with the work split by the script. Rows and run
+	 * cost are shared between the workers and the leader.
+	 */
+	if (baserel->consider_parallel && bms_is_empty(baserel->lateral_relids) && max_parallel_workers_per_gather > 0)
+	{
+		ForeignPath *path;
+		int workers = max_parallel_workers_per_gather;
+
+		path = create_foreignscan_path(root, baserel,
+									 NULL,      /* default pathtarget */
+									 baserel->rows / (workers + 1),
+									 startup_cost,
+									 startup_cost + (total_cost - startup_cost) / (workers + 1),
+									 NIL,		/* no pathkeys */
+									 NULL,		/* no outer rel either */
+									 NULL,      /* no extra plan */
+									 NIL);		/* no fdw_private data */
+
+		path->path.parallel_aware = true;
+		path->path.parallel_workers = workers;
+
+		add_partial_path(baserel, (Path *) path);
+	}
+#endif
+
+	lua_param_paths(root, baserel, foreigntableid, lua);
+}
+
+/*
+ * Collect the Params in an expression, eg $1 in a generic plan or a value
+ * from an outer query.
+ */
+static bool
+lua_param_walker (Node *node, List **params)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Param))
+	{
+		*params = list_append_unique(*params, node);
+		return false;
+	}
+
+	return expression_tree_walker(node, lua_param_walker, (void *) params);
+}
+
+static ForeignScan *
+luaGetForeignPlan (
+	PlannerInfo *root,
+	RelOptInfo *baserel,
+	Oid foreigntableid,
+	ForeignPath *best_path,
+	List *tlist,
+	List *scan_clauses,
+	Plan *outer_plan
+){
+	LuaFdwPlanState *plan_state;
+	List *private_state = NULL;
+	List *fdw_exprs = NIL;
+	List *param_attrs = NIL;
+	List *local_clauses = NIL;
+	List *remote_clauses = NIL;
+	List *params;
+	Relation rel;
+	ListCell *lc;
+	int attno;
+	int64 limit;
+	Expr *outer;
+
+	/*
+	 * Create a ForeignScan plan node from the selected foreign access path.
+	 * This is called at the end of query planning. The parameters are as for
+	 * GetForeignRelSize, plus the selected ForeignPath (previously produced
+	 * by GetForeignPaths), the target list to be emitted by the plan node,
+	 * and the restriction clauses to be enforced by the plan node.
+	 *
+	 * This function must create and return a ForeignScan plan node; it's
+	 * recommended to use make_foreignscan to build the ForeignScan node.
+	 *
+	 */
+
+	Index scan_relid = baserel->relid;
+
+	/*
+	 * Restriction clauses go into the plan node's qual list for the
+	 * executor to check, unless PlanClauses said the script applies them
+	 * exactly. Either way RestrictInfo nodes are stripped and pseudoconstants
+	 * ignored (they are handled elsewhere).
+	 */
+	//elog(WARNING, "%s", __func__);
+
+	if (baserel->reloptkind == RELOPT_JOINREL)
+		return lua_join_plan(root, baserel, tlist, outer_plan);
+
+#if PG_VERSION_NUM >= 100000
+	if (baserel->reloptkind == RELOPT_UPPER_REL)
+		return lua_upper_plan(baserel, tlist, outer_plan);
+#endif
+
+	plan_state = baserel->fdw_private;
+
+	/*
+	 * For a parameterized path, hand the outer side of each lookup clause to
+	 * the executor to evaluate. The clauses themselves stay in the local
+	 * qual list.
+	 */
+	if (best_path->path.param_info)
+	{
+		foreach(lc, scan_clauses)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+			if (list_member_ptr(best_path->path.param_info->ppi_clauses, rinfo)
+				&& lua_param_clause(root, rinfo, baserel->relid, &attno, &outer))
+			{
+				fdw_exprs = lappend(fdw_exprs, outer);
+				param_attrs = lappend_int(param_attrs, attno);
+			}
+		}
+	}
+
+	/* clauses the script enforces exactly are only rechecked for EPQ */
+	foreach(lc, scan_clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		if (rinfo->pseudoconstant)
+			continue;
+
+		if (list_member_ptr(plan_state->exact_clauses, rinfo))
+			remote_clauses = lappend(remote_clauses, rinfo->clause);
+		else
+			local_clauses = lappend(local_clauses, rinfo->clause);
+	}
+
+	/*
+	 * Params in the quals follow the nested loop keys in fdw_exprs, so the
+	 * executor evaluates them too and fdw.clauses can carry their values.
+	 */
+	params = NIL;
+	(void) lua_param_walker((Node *) local_clauses, &params);
+	fdw_exprs = list_concat(fdw_exprs, params);
+
+	private_state = lappend(private_state, lua_table_options(foreigntableid));
+
+	rel = table_open(foreigntableid, AccessShareLock);
+	private_state = lappend(private_state, lua_target_attrs(baserel, RelationGetDescr(rel)));
+	table_close(rel, AccessShareLock);
+
+	private_state = lappend(private_state, param_attrs);
+	private_state = lappend(private_state, best_path->fdw_private);	/* ordering */
+
+	/* the LIMIT only applies here if rows come in the order it expects */
+	if (best_path->path.param_info
+		|| (root->sort_pathkeys != NIL && !pathkeys_contained_in(root->sort_pathkeys, best_path->path.pathkeys)))
+		limit = 0;
+	else
+		limit = plan_state->limit;
+
+	private_state = lappend(private_state, makeInteger(limit));
+
+	/*
+	 * Nothing in the plan refers to the planner's Lua state, so it can be
+	 * cached and run any number of times. BeginForeignScan acquires a state
+	 * of its own, usually this one back from the pool.
+	 */
+	lua_release(plan_state->lua);
+
+	/* Create the ForeignScan node */
+	return make_foreignscan(
+		tlist,
+		local_clauses,
+		scan_relid,
+		fdw_exprs,	/* nested loop parameters */
+		private_state,	/* private state */
+		NIL,	/* no custom tlist */
+		remote_clauses,	/* applied by the script */
+		outer_plan
+	);
+}
+
+static LuaFdwColumn*
+lua_columns (lua_State *lua, TupleDesc desc, List *attrs)
+{
+	LuaFdwColumn *columns = palloc0(sizeof(LuaFdwColumn) * desc->natts);
+	Oid typinput, typoutput;
+	bool typisvarlena;
+	int i;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		columns[i].name_ref = LUA_NOREF;
+
+		if (TupleDescAttr(desc, i)->attisdropped)
+		{
+			columns[i].dropped = true;
+			continue;
+		}
+
+		lua_pushstring(lua, TupleDescAttr(desc, i)->attname.data);
+		columns[i].name_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+		columns[i].needed = list_member_int(attrs, i + 1);
+
+		columns[i].typid = TupleDescAttr(desc, i)->atttypid;
+		getTypeInputInfo(TupleDescAttr(desc, i)->atttypid, &typinput, &columns[i].typioparam);
+		fmgr_info(typinput, &columns[i].input);
+		columns[i].typmod = TupleDescAttr(desc, i)->atttypmod;
+
+		getTypeOutputInfo(TupleDescAttr(desc, i)->atttypid, &typoutput, &typisvarlena);
+		fmgr_info(typoutput, &columns[i].output);
+	}
+	return columns;
+}
+
+static void
+lua_columns_free (lua_State *lua, LuaFdwColumn *columns, int natts)
+{
+	int i;
+
+	for (i = 0; i < natts; i++)
+		luaL_unref(lua, LUA_REGISTRYINDEX, columns[i].name_ref);
+}
+
+static void
+lua_out_of_range (int64 value, const char *type)
+{
+	ereport(ERROR,
+		(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			errmsg("value \"" INT64_FORMAT "\" is out of range for type %s", value, type)));
+}
+
+/*
+ * Convert a Lua number straight to a numeric Datum without formatting it
+ * as text first. Returns false when the text input function should decide,
+ * eg a fractional value for an integer column, which it rejects as usual.
+ */
+static bool
+lua_number_datum (lua_State *lua, int index, LuaFdwColumn *column, Datum *datum)
+{
+	lua_Number n;
+	int64 i = 0;
+	bool is_integer;
+	float4 f;
+
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(lua, index))
+	{
+		/* exact, no detour through a double */
+		i = (int64) lua_tointeger(lua, index);
+		n = (lua_Number) i;
+		is_integer = true;
+	}
+	else
+#endif
+	{
+		n = lua_tonumber(lua, index);
+		is_integer = n == floor(n) && n >= -9223372036854775808.0 && n < 9223372036854775808.0;
+
+		if (is_integer)
+			i = (int64) n;
+	}
+
+	switch (column->typid)
+	{
+		case INT2OID:
+			if (!is_integer)
+				return false;
+			if (i < PG_INT16_MIN || i > PG_INT16_MAX)
+				lua_out_of_range(i, "smallint");
+			*datum = Int16GetDatum((int16) i);
+			return true;
+
+		case INT4OID:
+			if (!is_integer)
+				return false;
+			if (i < PG_INT32_MIN || i > PG_INT32_MAX)
+				lua_out_of_range(i, "integer");
+			*datum = Int32GetDatum((int32) i);
+			return true;
+
+		case INT8OID:
+			if (!is_integer)
+				return false;
+			*datum = Int64GetDatum(i);
+			return true;
+
+		case FLOAT4OID:
+			f = (float4) n;
+			if (isinf(f) && !isinf(n))
+				ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE), errmsg("value out of range: overflow")));
+			if (f == 0.0 && n != 0.0)
+				ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE), errmsg("value out of range: underflow")));
+			*datum = Float4GetDatum(f);
+			return true;
+
+		case FLOAT8OID:
+			*datum = Float8GetDatum((float8) n);
+			return true;
+
+		case NUMERICOID:
+			*datum = is_integer
+				? DirectFunctionCall1(int8_numeric, Int64GetDatum(i))
+				: DirectFunctionCall1(float8_numeric, Float8GetDatum((float8) n));
+
+			/* apply precision and scale, eg numeric(10,2) */
+			if (column->typmod >= 0)
+				*datum = DirectFunctionCall2(numeric, *datum, Int32GetDatum(column->typmod));
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Push a row table keyed by column name. NULLs are left out.
+ */
+static void
+lua_values_to_row (lua_State *lua, int natts, Datum *values, bool *isnull, LuaFdwColumn *columns)
+{
+	int i;
+
+	lua_createtable(lua, 0, natts);
+
+	for (i = 0; i < natts; i++)
+	{
+		if (columns[i].dropped || isnull[i])
+			continue;
+
+		lua_rawgeti(lua, LUA_REGISTRYINDEX, columns[i].name_ref);
+		lua_push_datum(lua, values[i], false, columns[i].typid, &columns[i].output);
+		lua_rawset(lua, -3);
+	}
+}
+
+static void
+lua_slot_to_row (lua_State *lua, TupleTableSlot *slot, LuaFdwColumn *columns)
+{
+	slot_getallattrs(slot);
+	lua_values_to_row(lua, slot->tts_tupleDescriptor->natts, slot->tts_values, slot->tts_isnull, columns);
+}
+
+/*
+ * Push a whole-row Datum of the table's rowtype as a row table.
+ */
+static void
+lua_record_to_row (lua_State *lua, Datum record, TupleDesc desc, LuaFdwColumn *columns)
+{
+	HeapTupleHeader td = DatumGetHeapTupleHeader(record);
+	HeapTupleData tuple;
+	Datum *values = palloc(sizeof(Datum) * desc->natts);
+	bool *isnull = palloc(sizeof(bool) * desc->natts);
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+	ItemPointerSetInvalid(&tuple.t_self);
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = td;
+
+	heap_deform_tuple(&tuple, desc, values, isnull);
+	lua_values_to_row(lua, desc->natts, values, isnull, columns);
+
+	pfree(values);
+	pfree(isnull);
+}
+
+/*
+ * fdw.next_chunk(): claim the next unit of work, 0, 1, 2, ... shared by
+ * every process taking part in the scan.
+ */
+static int
+lua_next_chunk (lua_State *lua)
+{
+	LuaFdwScanState *scan_state = (LuaFdwScanState *) lua_touserdata(lua, lua_upvalueindex(1));
+
+	lua_pushinteger(lua, (lua_Integer) pg_atomic_fetch_add_u64(&scan_state->shared->next_chunk, 1));
+	return 1;
+}
+
+/*
+ * fdw.rows_fetched(): rows the scan has returned so far.
+ */
+static int
+lua_rows_fetched (lua_State *lua)
+{
+	LuaFdwScanState *scan_state = (LuaFdwScanState *) lua_touserdata(lua, lua_upvalueindex(1));
+
+	lua_pushinteger(lua, (lua_Integer) scan_state->rows_fetched);
+	return 1;
+}
+
+/*
+ * Set fdw.worker_id, fdw.nworkers and fdw.next_chunk.
+ */
+static void
+lua_parallel_globals (LuaFdwScanState *scan_state, int worker_id)
+{
+	lua_State *lua = scan_state->lua;
+
+	lua_getglobal(lua, "fdw");
+
+	lua_pushstring(lua, "worker_id");
+	lua_pushinteger(lua, worker_id);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "nworkers");
+	lua_pushinteger(lua, scan_state->shared->nworkers);
+	lua_settable(lua, -3);
+
+	lua_pushstring(lua, "next_chunk");
+	lua_pushlightuserdata(lua, scan_state);
+	lua_pushcclosure(lua, lua_next_chunk, 1);
+	lua_settable(lua, -3);
+
+	lua_pop(lua, 1); // fdw
+}
+
+typedef struct
+{
+	List *params;	/* Param nodes */
+	List *values;	/* a Const for each */
+} LuaFdwParamValues;
+
+static Node*
+lua_param_mutator (Node *node, LuaFdwParamValues *context)
+{
+	ListCell *lc1, *lc2;
+
+	if (node == NULL)
+		return NULL;
+
+	if (IsA(node, Param))
+	{
+		forboth(lc1, context->params, lc2, context->values)
+		{
+			if (equal(node, lfirst(lc1)))
+				return (Node *) copyObject(lfirst(lc2));
+		}
+	}
+
+	return expression_tree_mutator(node, lua_param_mutator, (void *) context);
+}
+
+/*
+ * Evaluate nested loop parameters and publish them as fdw.params. Params in
+ * the quals are then substituted as constants, and fdw.clauses and
+ * fdw.quals built again to include them.
+ */
+static void
+lua_params (ForeignScanState *node, LuaFdwScanState *scan_state)
+{
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	TupleDesc desc = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+	lua_State *lua = scan_state->lua;
+	MemoryContext oldcontext;
+	LuaFdwParamValues context;
+	ListCell *lc;
+	ExprState *expr;
+	Param *param;
+	Datum value;
+	bool isnull;
+	int16 typlen;
+	bool typbyval;
+	int i = 1;
+
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	lua_getglobal(lua, "fdw");
+	lua_pushstring(lua, "params");
+	lua_createtable(lua, list_length(scan_state->param_attrs), 0);
+
+	context.params = scan_state->clause_params;
+	context.values = NIL;
+
+	foreach(lc, scan_state->param_exprs)
+	{
+		expr = (ExprState *) lfirst(lc);
+#if PG_VERSION_NUM >= 100000
+		value = ExecEvalExpr(expr, econtext, &isnull);
+#else
+		value = ExecEvalExpr(expr, econtext, &isnull, NULL);
+#endif
+		if (i > list_length(scan_state->param_attrs))
+		{
+			param = (Param *) list_nth(context.params, list_length(context.values));
+			get_typlenbyval(param->paramtype, &typlen, &typbyval);
+			context.values = lappend(context.values, makeConst(param->paramtype, param->paramtypmod,
+				param->paramcollid, typlen, value, isnull, typbyval));
+			i++;
+			continue;
+		}
+
+		lua_createtable(lua, 0, 3);
+
+		lua_pushstring(lua, "column");
+		lua_pushstring(lua, TupleDescAttr(desc, list_nth_int(scan_state->param_attrs, i - 1) - 1)->attname.data);
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "operator");
+		lua_pushstring(lua, "eq");
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "value");
+		lua_push_datum(lua, value, isnull, exprType((Node *) expr->expr), NULL);
+		lua_settable(lua, -3);
+
+		lua_rawseti(lua, -2, i++);
+	}
+
+	lua_settable(lua, -3); // params
+
+	if (context.params != NIL)
+		lua_clause_list(lua, desc, (List *) lua_param_mutator((Node *) scan_state->quals, &context));
+
+	lua_pop(lua, 1); // fdw
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Fill a slot from the Lua row table on top of the stack. The table is left
+ * in place. Rows are either arrays indexed by attribute number, or keyed by
+ * column name.
+ */
+static void
+lua_row_to_slot (lua_State *lua, TupleTableSlot *slot, LuaFdwColumn *columns)
+{
+	TupleDesc desc = slot->tts_tupleDescriptor;
+	LuaFdwColumn *column;
+	int i;
+	char *value;
+	bool positional = lua_rawlen(lua, -1) > 0;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		column = &columns[i];
+		slot->tts_isnull[i] = true;
+
+		/* unreferenced columns stay NULL without conversion */
+		if (column->dropped || !column->needed)
+			continue;
+
+		if (positional)
+			lua_rawgeti(lua, -1, i+1);
+		else
+		{
+			lua_rawgeti(lua, LUA_REGISTRYINDEX, column->name_ref);
+			lua_gettable(lua, -2);
+		}
+
+		switch (lua_type(lua, -1))
+		{
+			case LUA_TNUMBER:
+				if (lua_number_datum(lua, -1, column, &slot->tts_values[i]))
+				{
+					slot->tts_isnull[i] = false;
+					break;
+				}
+				/* fall through */
+
+			case LUA_TSTRING:
+				value = (char*)lua_tostring(lua, -1);
+				slot->tts_isnull[i] = false;
+				slot->tts_values[i] = InputFunctionCall(&column->input, value, column->typioparam, column->typmod);
+				break;
+
+			case LUA_TBOOLEAN:
+				slot->tts_isnull[i] = false;
+
+				if (column->typid == BOOLOID)
+					slot->tts_values[i] = BoolGetDatum(lua_toboolean(lua, -1));
+				else
+					slot->tts_values[i] = InputFunctionCall(&column->input, lua_toboolean(lua, -1) ? "true" : "false", column->typioparam, column->typmod);
+				break;
+		}
+		lua_pop(lua, 1);
+	}
+	ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * Push the next row from the current ScanIterateBatch array, calling it
+ * again when the array runs dry. Pushes nil at the end of the scan.
+ */
+static void
+lua_batch_next (LuaFdwScanState *scan_state)
+{
+	lua_State *lua = scan_state->lua;
+	int n;
+
+	while (!scan_state->batch_done && scan_state->batch_pos > scan_state->batch_len)
+	{
+		luaL_unref(lua, LUA_REGISTRYINDEX, scan_state->batch_ref);
+		scan_state->batch_ref = LUA_NOREF;
+		scan_state->batch_len = 0;
+		scan_state->batch_pos = 1;
+
+		n = scan_state->fetch_size;
+
+		/* no more than a LIMIT still needs */
+		if (scan_state->limit > 0 && scan_state->limit - scan_state->rows_fetched < n)
+			n = (int) (scan_state->limit - scan_state->rows_fetched);
+
+		lua_pushinteger(lua, n);
+		lua_callback_ref(lua, scan_state->iterate_batch_fn, 1, 1);
+
+		if (lua_istable(lua, -1) && lua_rawlen(lua, -1) > 0)
+		{
+			scan_state->batch_len = lua_rawlen(lua, -1);
+			scan_state->batch_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+		}
+		else
+		{
+			scan_state->batch_done = true;
+			lua_pop(lua, 1);
+		}
+	}
+
+	if (scan_state->batch_done)
+	{
+		lua_pushnil(lua);
+		return;
+	}
+
+	lua_rawgeti(lua, LUA_REGISTRYINDEX, scan_state->batch_ref);
+	lua_rawgeti(lua, -1, scan_state->batch_pos++);
+	lua_remove(lua, -2);
+}
+
+static void
+lua_batch_reset (LuaFdwScanState *scan_state)
+{
+	luaL_unref(scan_state->lua, LUA_REGISTRYINDEX, scan_state->batch_ref);
+	scan_state->batch_ref = LUA_NOREF;
+	scan_state->batch_len = 0;
+	scan_state->batch_pos = 1;
+	scan_state->batch_done = false;
+}
+
+/*
+ * lua_resume across Lua versions. Values yielded or returned are left on
+ * the coroutine's stack and counted in *results.
+ */
+static int
+lua_resume_values (lua_State *co, lua_State *from, int args, int *results)
+{
+	int status;
+
+#if LUA_VERSION_NUM >= 504
+	status = lua_resume(co, from, args, results);
+#elif LUA_VERSION_NUM >= 502
+	status = lua_resume(co, from, args);
+	*results = lua_gettop(co);
+#else
+	status = lua_resume(co, args);
+	*results = lua_gettop(co);
+#endif
+
+	return status;
+}
+
+/*
+ * Start a fresh coroutine for ScanIterate, abandoning any suspended call.
+ */
+static void
+lua_coroutine_reset (LuaFdwScanState *scan_state)
+{
+	luaL_unref(scan_state->lua, LUA_REGISTRYINDEX, scan_state->thread_ref);
+
+	scan_state->thread = lua_newthread(scan_state->lua);
+	scan_state->thread_ref = luaL_ref(scan_state->lua, LUA_REGISTRYINDEX);
+	scan_state->running = false;
+	scan_state->waiting = false;
+}
+
+/*
+ * Run ScanIterate until it returns or yields. On return, its row (or nil)
+ * is pushed on the main stack and true returned. A yield of a socket,
+ * optionally followed by "write", leaves the call suspended and returns
+ * false with wait_fd and wait_events set.
+ */
+static bool
+lua_coroutine_step (LuaFdwScanState *scan_state)
+{
+	lua_State *lua = scan_state->lua;
+	lua_State *co = scan_state->thread;
+	int status, results;
+
+	scan_state->waiting = false;
+
+	if (!scan_state->running)
 	{
-		if (lua_isnumber(lua, -1))
-			startup_cost = lua_tonumber(lua, -1);
+		if (scan_state->iterate_fn == LUA_NOREF)
+		{
+			lua_pushnil(lua);
+			return true;
+		}
 
-		lua_pop(lua, 1);
+		lua_settop(co, 0);
+		lua_rawgeti(co, LUA_REGISTRYINDEX, scan_state->iterate_fn);
+		scan_state->running = true;
 	}
 
-	if (lua_callback(lua, "EstimateTotalCost", 0, 1))
+	lua_limit_begin(lua);
+	status = lua_resume_values(co, lua, 0, &results);
+	lua_limit_end(lua);
+
+	if (status == LUA_YIELD)
 	{
-		if (lua_isnumber(lua, -1))
-			total_cost = lua_tonumber(lua, -1);
+		if (results < 1 || !lua_isnumber(co, -results))
+			ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: ScanIterate must yield a socket to wait on")));
+
+		scan_state->wait_fd = (pgsocket) lua_tointeger(co, -results);
+		scan_state->wait_events = WL_SOCKET_READABLE;
+
+		if (results > 1 && lua_isstring(co, 1 - results) && strcmp(lua_tostring(co, 1 - results), "write") == 0)
+			scan_state->wait_events = WL_SOCKET_WRITEABLE;
+
+		lua_settop(co, 0);
+		scan_state->waiting = true;
+		return false;
+	}
+
+	scan_state->running = false;
+
+	if (status != 0)
+		ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(co, -1))));
+
+	if (results > 0)
+	{
+		lua_settop(co, lua_gettop(co) - results + 1);
+		lua_xmove(co, lua, 1);
+	}
+	else
+		lua_pushnil(lua);
+
+	lua_settop(co, 0);
+	return true;
+}
+
+/*
+ * Block until the socket ScanIterate yielded is ready.
+ */
+static void
+lua_coroutine_wait (LuaFdwScanState *scan_state)
+{
+	int rc;
+
+#if PG_VERSION_NUM >= 120000
+	rc = WaitLatchOrSocket(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | scan_state->wait_events, scan_state->wait_fd, -1L, PG_WAIT_EXTENSION);
+#elif PG_VERSION_NUM >= 100000
+	rc = WaitLatchOrSocket(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH | scan_state->wait_events, scan_state->wait_fd, -1L, PG_WAIT_EXTENSION);
+#else
+	rc = WaitLatchOrSocket(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH | scan_state->wait_events, scan_state->wait_fd, -1L);
+#endif
+
+#if PG_VERSION_NUM < 120000
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+#endif
+
+	if (rc & WL_LATCH_SET)
+		ResetLatch(MyLatch);
+
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * Resolve scan callbacks and options, and set up fdw.next_chunk() for a
+ * serial scan. Parallel scans attach shared state later.
+ */
+static void
+lua_scan_init (LuaFdwScanState *scan_state, Oid foreigntableid)
+{
+	lua_State *lua = scan_state->lua;
+	DefElem *def;
+
+	pg_atomic_init_u64(&scan_state->local.next_chunk, 0);
+	scan_state->local.nworkers = 1;
+	scan_state->shared = &scan_state->local;
+	lua_parallel_globals(scan_state, 0);
+
+	lua_getglobal(lua, "fdw");
+	lua_pushstring(lua, "rows_fetched");
+	lua_pushlightuserdata(lua, scan_state);
+	lua_pushcclosure(lua, lua_rows_fetched, 1);
+	lua_settable(lua, -3);
+	lua_pop(lua, 1); // fdw
+
+	def = lua_option(foreigntableid, "fetch_size");
+	scan_state->fetch_size = def ? lua_option_int(def, 1) : 1000;
+	scan_state->batch_ref = LUA_NOREF;
+	scan_state->batch_pos = 1;
+
+	scan_state->iterate_fn = lua_function_ref(lua, "ScanIterate");
+	scan_state->iterate_batch_fn = lua_function_ref(lua, "ScanIterateBatch");
+	scan_state->use_batch = scan_state->iterate_batch_fn != LUA_NOREF;
+
+	/* async scripts yield from ScanIterate, so ScanIterateBatch is unused */
+	def = lua_option(foreigntableid, "async_capable");
+	scan_state->use_coroutine = def && defGetBoolean(def);
+	scan_state->thread_ref = LUA_NOREF;
+
+	if (scan_state->use_coroutine)
+	{
+		scan_state->use_batch = false;
+		lua_coroutine_reset(scan_state);
+	}
+}
+
+static void
+lua_scan_free (LuaFdwScanState *scan_state, int natts)
+{
+	lua_State *lua = scan_state->lua;
+
+	lua_batch_reset(scan_state);
+
+	luaL_unref(lua, LUA_REGISTRYINDEX, scan_state->iterate_fn);
+	luaL_unref(lua, LUA_REGISTRYINDEX, scan_state->iterate_batch_fn);
+	luaL_unref(lua, LUA_REGISTRYINDEX, scan_state->thread_ref);
+	lua_columns_free(lua, scan_state->columns, natts);
+}
+
+/*
+ * Fetch the next row into slot from whichever iterate callback the script
+ * uses. The slot is left empty at the end of the scan, or when an async
+ * scan is suspended on its socket (see waiting).
+ */
+static void
+lua_scan_row (LuaFdwScanState *scan_state, TupleTableSlot *slot)
+{
+	lua_State *lua = scan_state->lua;
+	TupleDesc desc = slot->tts_tupleDescriptor;
+
+	memset (slot->tts_values, 0, sizeof(Datum) * desc->natts);
+	memset (slot->tts_isnull, true, sizeof(bool) * desc->natts);
+
+	ExecClearTuple(slot);
+
+	/* a LIMIT has all it needs, don't ask the script for more */
+	if (scan_state->limit > 0 && scan_state->rows_fetched >= scan_state->limit)
+		return;
+
+	if (scan_state->use_batch)
+	{
+		/* skip holes, a nil entry is not end-of-scan */
+		do
+		{
+			lua_batch_next(scan_state);
+
+			if (lua_istable(lua, -1))
+				lua_row_to_slot(lua, slot, scan_state->columns);
+
+			lua_pop(lua, 1);
+		}
+		while (TupIsNull(slot) && !scan_state->batch_done);
+	}
+	else
+	if (scan_state->use_coroutine)
+	{
+		while (!lua_coroutine_step(scan_state))
+		{
+			/* Append only waits for sockets to become readable */
+			if (scan_state->async && scan_state->wait_events == WL_SOCKET_READABLE)
+				return;
+
+			lua_coroutine_wait(scan_state);
+		}
+
+		if (lua_istable(lua, -1))
+			lua_row_to_slot(lua, slot, scan_state->columns);
 
 		lua_pop(lua, 1);
 	}
+	else
+	if (lua_callback_ref(lua, scan_state->iterate_fn, 0, 1))
+	{
+		if (lua_istable(lua, -1))
+			lua_row_to_slot(lua, slot, scan_state->columns);
 
-	/* Create a ForeignPath node and add it as only possible path */
-	add_path(baserel, (Path *)
-			 create_foreignscan_path(root, baserel,
-#if (PG_VERSION_NUM >= 90600)
-									 NULL,      /* default pathtarget */
+		lua_pop(lua, 1);
+	}
+
+	if (!TupIsNull(slot))
+		scan_state->rows_fetched++;
+}
+
+/*
+ * Acquire a Lua state for a scan and describe the scan in fdw, all from the
+ * plan: it may be cached and run many times, or run in a parallel or
+ * prefetch worker. Joins name their columns "alias.column".
+ */
+static void
+lua_scan_setup (LuaFdwScanState *scan_state, TupleDesc desc, Oid foreigntableid, List *fdw_private, List *quals, bool pushdown)
+{
+	List *attrs = (List *) list_nth(fdw_private, LuaFdwPrivateAttrs);
+	List *order_by;
+
+	scan_state->lua = lua_options_acquire((List *) list_nth(fdw_private, LuaFdwPrivateOptions));
+
+	lua_getglobal(scan_state->lua, "fdw");
+
+	if (pushdown && list_length((List *) list_nth(fdw_private, LuaFdwPrivateRelids)) == 1)
+		lua_aggregate_describe(scan_state->lua, fdw_private);
+	else
+	{
+		lua_describe(scan_state->lua, foreigntableid, desc);
+		lua_clause_list(scan_state->lua, desc, quals);
+
+		if (pushdown)
+			lua_join_describe(scan_state->lua, fdw_private);
+	}
+
+	lua_pop(scan_state->lua, 1);
+
+	scan_state->columns = lua_columns(scan_state->lua, desc, attrs);
+
+	lua_getglobal(scan_state->lua, "fdw");
+	lua_target(scan_state->lua, desc, attrs);
+
+	lua_pushstring(scan_state->lua, "order_by");
+	order_by = (List *) list_nth(fdw_private, LuaFdwPrivateOrderBy);
+	if (order_by != NIL)
+		lua_order_list(scan_state->lua, order_by);
+	else
+		lua_pushnil(scan_state->lua);
+	lua_settable(scan_state->lua, -3); // order_by
+
+	scan_state->limit = intVal(list_nth(fdw_private, LuaFdwPrivateLimit));
+
+	lua_pushstring(scan_state->lua, "limit");
+	if (scan_state->limit > 0)
+		lua_pushinteger(scan_state->lua, (lua_Integer) scan_state->limit);
+	else
+		lua_pushnil(scan_state->lua);
+	lua_settable(scan_state->lua, -3); // limit
+
+	lua_pop(scan_state->lua, 1);
+
+	lua_scan_init(scan_state, foreigntableid);
+}
+
+/*
+ * Whether a background worker runs the scan, or is about to.
+ */
+static bool
+lua_scan_prefetch (LuaFdwScanState *scan_state)
+{
+#if PG_VERSION_NUM >= 90600
+	return scan_state->prefetch;
+#else
+	return false;
 #endif
-									 baserel->rows,
-									 startup_cost,
-									 total_cost,
-									 NIL,		/* no pathkeys */
-									 NULL,		/* no outer rel either */
-#if (PG_VERSION_NUM >= 90500)
-									 NULL,      /* no extra plan */
+}
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Prefetch scans run the script in a background worker, which sends rows
+ * back as heap tuples through a shm_mq. The ring gives backpressure both
+ * ways: the worker blocks when the leader falls behind, and the leader when
+ * the script does. Ending or cancelling the scan detaches the queue, which
+ * stops the worker at its next row.
+ *
+ * The segment holds this header, the serialized plan, the leader's GUC
+ * settings, then the queue.
+ */
+#define LUA_FDW_PREFETCH_QUEUE (256 * 1024)
+
+typedef struct
+{
+	Oid database;
+	Oid authenticated_user;
+	Oid current_user;
+	int sec_context;
+	Oid relid;
+	Size guc;	/* offsets from the header */
+	Size queue;
+	char plan[FLEXIBLE_ARRAY_MEMBER];	/* fdw_private and quals */
+} LuaFdwPrefetch;
+
+/*
+ * Whether this transaction created or altered the table. A prefetch worker
+ * runs in a transaction of its own, and would see the committed definition
+ * or none at all.
+ */
+static bool
+lua_prefetch_changed (Relation rel)
+{
+	Oid relid = RelationGetRelid(rel);
+	int caches[] = {RELOID, FOREIGNTABLEREL};
+	int i;
+
+	if (rel->rd_createSubid != InvalidSubTransactionId)
+		return true;
+
+#if PG_VERSION_NUM >= 120000
+	/* any ALTER FOREIGN TABLE takes this */
+	if (CheckRelationLockedByMe(rel, AccessExclusiveLock, true))
+		return true;
 #endif
-									 NIL));		/* no fdw_private data */
+
+	for (i = 0; i < lengthof(caches); i++)
+	{
+		HeapTuple tuple = SearchSysCache1(caches[i], ObjectIdGetDatum(relid));
+		bool current;
+
+		if (!HeapTupleIsValid(tuple))
+			return true;
+
+		current = TransactionIdIsCurrentTransactionId(HeapTupleHeaderGetXmin(tuple->t_data));
+		ReleaseSysCache(tuple);
+
+		if (current)
+			return true;
+	}
+
+	return false;
 }
 
-static ForeignScan *
-luaGetForeignPlan (
-	PlannerInfo *root,
-	RelOptInfo *baserel,
-	Oid foreigntableid,
-	ForeignPath *best_path,
-	List *tlist,
-	List *scan_clauses,
-	Plan *outer_plan
-){
-	LuaFdwPlanState *plan_state;
-	lua_State *lua;
-	List *private_state = NULL;
+/*
+ * Send one message: a tag byte, 'T' tuple, 'E' error or 'Z' end of scan,
+ * followed by its data.
+ */
+static shm_mq_result
+lua_prefetch_send (shm_mq_handle *mqh, char tag, const void *data, Size len)
+{
+	shm_mq_iovec iov[2];
 
-	/*
-	 * Create a ForeignScan plan node from the selected foreign access path.
-	 * This is called at the end of query planning. The parameters are as for
-	 * GetForeignRelSize, plus the selected ForeignPath (previously produced
-	 * by GetForeignPaths), the target list to be emitted by the plan node,
-	 * and the restriction clauses to be enforced by the plan node.
-	 *
-	 * This function must create and return a ForeignScan plan node; it's
-	 * recommended to use make_foreignscan to build the ForeignScan node.
-	 *
-	 */
+	iov[0].data = &tag;
+	iov[0].len = 1;
+	iov[1].data = (const char *) data;
+	iov[1].len = len;
+
+#if PG_VERSION_NUM >= 150000
+	return shm_mq_sendv(mqh, iov, 2, false, true);
+#else
+	return shm_mq_sendv(mqh, iov, 2, false);
+#endif
+}
+
+/*
+ * Start a worker for the scan. False if none is available, in which case
+ * the leader scans by itself.
+ */
+static bool
+lua_prefetch_start (ForeignScanState *node, LuaFdwScanState *scan_state)
+{
+	ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+	LuaFdwPrefetch *header;
+	BackgroundWorker worker;
+	MemoryContext oldcxt;
+	shm_mq *mq;
+	char *text;
+	Size guc, gucsize, queue;
+
+	/* the handles outlive this row's memory context */
+	oldcxt = MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
+
+	text = nodeToString(list_make2(plan->fdw_private,
+		list_concat(list_copy(plan->scan.plan.qual), plan->fdw_recheck_quals)));
+	guc = MAXALIGN(offsetof(LuaFdwPrefetch, plan) + strlen(text) + 1);
+	gucsize = EstimateGUCStateSpace();
+	queue = MAXALIGN(guc + gucsize);
+
+	scan_state->prefetch_seg = dsm_create(queue + LUA_FDW_PREFETCH_QUEUE, 0);
+
+	header = (LuaFdwPrefetch *) dsm_segment_address(scan_state->prefetch_seg);
+	header->database = MyDatabaseId;
+	header->authenticated_user = GetAuthenticatedUserId();
+	GetUserIdAndSecContext(&header->current_user, &header->sec_context);
+	header->relid = RelationGetRelid(node->ss.ss_currentRelation);
+	header->guc = guc;
+	header->queue = queue;
+	strcpy(header->plan, text);
+	SerializeGUCState(gucsize, (char *) header + guc);
+
+	mq = shm_mq_create((char *) header + queue, LUA_FDW_PREFETCH_QUEUE);
+	shm_mq_set_receiver(mq, MyProc);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "lua_fdw");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "lua_prefetch_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "lua_fdw prefetch for PID %d", MyProcPid);
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "lua_fdw prefetch");
+#endif
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(scan_state->prefetch_seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &scan_state->prefetch_worker))
+	{
+		dsm_detach(scan_state->prefetch_seg);
+		scan_state->prefetch_seg = NULL;
+		MemoryContextSwitchTo(oldcxt);
+		return false;
+	}
+
+	/* with the worker handle, receiving fails if the worker dies */
+	scan_state->prefetch_mq = shm_mq_attach(mq, scan_state->prefetch_seg, scan_state->prefetch_worker);
+	scan_state->prefetch_done = false;
+
+	MemoryContextSwitchTo(oldcxt);
+	return true;
+}
+
+/*
+ * Stop the worker, if any. It notices the detached queue or the signal,
+ * whichever comes first.
+ */
+static void
+lua_prefetch_stop (LuaFdwScanState *scan_state)
+{
+	if (scan_state->prefetch_seg == NULL)
+		return;
+
+#if PG_VERSION_NUM >= 100000
+	shm_mq_detach(scan_state->prefetch_mq);
+#else
+	shm_mq_detach(shm_mq_get_queue(scan_state->prefetch_mq));
+#endif
+	TerminateBackgroundWorker(scan_state->prefetch_worker);
+	dsm_detach(scan_state->prefetch_seg);
+
+	scan_state->prefetch_seg = NULL;
+	scan_state->prefetch_mq = NULL;
+	scan_state->prefetch_worker = NULL;
+}
+
+/*
+ * Receive the next row from the worker into slot, waiting for it if need
+ * be. The slot is left empty at the end of the scan.
+ */
+static void
+lua_prefetch_row (LuaFdwScanState *scan_state, TupleTableSlot *slot)
+{
+	HeapTupleData tuple;
+	shm_mq_result result;
+	Size nbytes;
+	void *data;
+	char *message;
+
+	ExecClearTuple(slot);
+
+	if (scan_state->prefetch_done)
+		return;
+
+	result = shm_mq_receive(scan_state->prefetch_mq, &nbytes, &data, false);
+
+	if (result != SHM_MQ_SUCCESS || nbytes == 0)
+		ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw prefetch worker exited unexpectedly")));
+
+	message = (char *) data;
+
+	switch (message[0])
+	{
+		case 'T':
+			/* the message is only valid until the next receive, and unaligned */
+			tuple.t_len = nbytes - 1;
+			tuple.t_data = (HeapTupleHeader) palloc(tuple.t_len);
+			memcpy(tuple.t_data, message + 1, tuple.t_len);
+			ItemPointerSetInvalid(&tuple.t_self);
+			tuple.t_tableOid = InvalidOid;
+
+			heap_deform_tuple(&tuple, slot->tts_tupleDescriptor, slot->tts_values, slot->tts_isnull);
+			ExecStoreVirtualTuple(slot);
+			scan_state->rows_fetched++;
+			break;
+
+		case 'E':
+			ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("%s", message + 1),
+				errcontext("lua_fdw prefetch worker")));
+			break;
+
+		default:
+			scan_state->prefetch_done = true;
+			break;
+	}
+}
+
+/*
+ * Background worker entry point: run the scan described by the leader and
+ * send each row back.
+ */
+void
+lua_prefetch_main (Datum main_arg)
+{
+	LuaFdwScanState scan_state;
+	LuaFdwPrefetch *header;
+	dsm_segment *seg;
+	shm_mq *mq;
+	shm_mq_handle *mqh;
+	List *plan;
+	Relation rel;
+	TupleDesc desc;
+	TupleTableSlot *slot;
+	MemoryContext row_cxt;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
 
-	Index scan_relid = baserel->relid;
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+
+	if (seg == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("lua_fdw prefetch worker could not map dynamic shared memory segment")));
+
+	header = (LuaFdwPrefetch *) dsm_segment_address(seg);
+	mq = (shm_mq *) ((char *) header + header->queue);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(header->database, header->authenticated_user, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(header->database, header->authenticated_user);
+#endif
 
 	/*
-	 * We have no native ability to evaluate restriction clauses, so we just
-	 * put all the scan_clauses into the plan node's qual list for the
-	 * executor to check. So all we have to do here is strip RestrictInfo
-	 * nodes from the clauses and ignore pseudoconstants (which will be
-	 * handled elsewhere).
+	 * Settings are the leader's, not this process's defaults, restored as a
+	 * parallel worker does: in a transaction, for check hooks that look at
+	 * the catalogs, then with the leader's current user.
 	 */
-	//elog(WARNING, "%s", __func__);
+	StartTransactionCommand();
+	RestoreGUCState((char *) header + header->guc);
+	CommitTransactionCommand();
 
-	plan_state = baserel->fdw_private;
-	lua = plan_state->lua;
+	SetUserIdAndSecContext(header->current_user, header->sec_context);
 
-	lua_clauses(lua, baserel, foreigntableid);
+	StartTransactionCommand();
 
-	scan_clauses = extract_actual_clauses(scan_clauses, false);
-	private_state = lappend(private_state, makeConst(VOIDOID, -1, InvalidOid, -1, PointerGetDatum(lua), false, true));
+	plan = (List *) stringToNode(header->plan);
+	rel = table_open(header->relid, AccessShareLock);
+	desc = RelationGetDescr(rel);
 
-	/* Create the ForeignScan node */
-	return make_foreignscan(
-		tlist,
-		scan_clauses,
-		scan_relid,
-		NIL,	/* no expressions to evaluate */
-		private_state,	/* private state */
-		NIL,	/* no custom tlist */
-		NIL,    /* no remote quals */
-		outer_plan
-	);
+#if PG_VERSION_NUM >= 120000
+	slot = MakeSingleTupleTableSlot(desc, &TTSOpsVirtual);
+#else
+	slot = MakeSingleTupleTableSlot(desc);
+#endif
+
+	row_cxt = AllocSetContextCreate(CurrentMemoryContext, "lua_fdw prefetch row", ALLOCSET_DEFAULT_SIZES);
+
+	memset(&scan_state, 0, sizeof(scan_state));
+
+	PG_TRY();
+	{
+		lua_scan_setup(&scan_state, desc, header->relid, (List *) linitial(plan), (List *) lsecond(plan), false);
+
+		lua_pushboolean(scan_state.lua, 0);
+		lua_callback(scan_state.lua, "ScanStart", 1, 0);
+
+		for (;;)
+		{
+			MemoryContext oldcxt;
+			HeapTuple tuple;
+			shm_mq_result result;
+
+			CHECK_FOR_INTERRUPTS();
+
+			MemoryContextReset(row_cxt);
+			oldcxt = MemoryContextSwitchTo(row_cxt);
+
+			lua_scan_row(&scan_state, slot);
+
+			if (TupIsNull(slot))
+			{
+				MemoryContextSwitchTo(oldcxt);
+				break;
+			}
+
+			tuple = heap_form_tuple(desc, slot->tts_values, slot->tts_isnull);
+			result = lua_prefetch_send(mqh, 'T', tuple->t_data, tuple->t_len);
+
+			MemoryContextSwitchTo(oldcxt);
+
+			/* the leader ended the scan early */
+			if (result != SHM_MQ_SUCCESS)
+				break;
+		}
+
+		lua_callback(scan_state.lua, "ScanEnd", 0, 0);
+		lua_prefetch_send(mqh, 'Z', NULL, 0);
+	}
+	PG_CATCH();
+	{
+		ErrorData *edata;
+
+		/* report to the leader, then exit through the usual error path */
+		MemoryContextSwitchTo(TopMemoryContext);
+		edata = CopyErrorData();
+		lua_prefetch_send(mqh, 'E', edata->message, strlen(edata->message) + 1);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	lua_scan_free(&scan_state, desc->natts);
+	lua_release(scan_state.lua);
+
+	ExecDropSingleTupleTableSlot(slot);
+	table_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
 }
+#endif
 
 static void
 luaBeginForeignScan (ForeignScanState *node, int eflags)
 {
 	ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
 	LuaFdwScanState *scan_state;
+	TupleDesc desc = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+	Oid foreigntableid;
+	List *quals;
+	bool pushdown = plan->scan.scanrelid == 0;	/* join or aggregate */
 
 	/*
 	 * Begin executing a foreign scan. This is called during executor startup.
@@ -1018,10 +4777,54 @@ luaBeginForeignScan (ForeignScanState *node, int eflags)
 	scan_state = palloc0(sizeof(LuaFdwScanState));
 	node->fdw_state = scan_state;
 
-	scan_state->lua = (lua_State*) DatumGetPointer(((Const*)(linitial(plan->fdw_private)))->constvalue);
+	/* joins and aggregates take their options from the (outer) table */
+	if (pushdown)
+		foreigntableid = linitial_oid((List *) list_nth(plan->fdw_private, LuaFdwPrivateRelids));
+	else
+		foreigntableid = RelationGetRelid(node->ss.ss_currentRelation);
+
+	quals = list_concat(list_copy(plan->scan.plan.qual), plan->fdw_recheck_quals);
+	lua_scan_setup(scan_state, desc, foreigntableid, plan->fdw_private, quals, pushdown);
+
+#if PG_VERSION_NUM >= 140000
+	scan_state->async = node->ss.ps.async_capable;
+#endif
+
+	scan_state->param_attrs = (List *) list_nth(plan->fdw_private, LuaFdwPrivateParams);
+	scan_state->clause_params = list_copy_tail(plan->fdw_exprs, list_length(scan_state->param_attrs));
+	scan_state->quals = quals;
+#if PG_VERSION_NUM >= 100000
+	scan_state->param_exprs = ExecInitExprList(plan->fdw_exprs, (PlanState *) node);
+#else
+	scan_state->param_exprs = (List *) ExecInitExpr((Expr *) plan->fdw_exprs, (PlanState *) node);
+#endif
+
+#if PG_VERSION_NUM >= 90600
+	/* only plain scans, the worker has no parameters or shared state */
+	if (!pushdown && plan->fdw_exprs == NIL && !plan->scan.plan.parallel_aware
+		&& !scan_state->async && !IsParallelWorker())
+	{
+		DefElem *def = lua_option(foreigntableid, "prefetch");
+		scan_state->prefetch = def && defGetBoolean(def)
+			&& !lua_prefetch_changed(node->ss.ss_currentRelation);
+	}
+#endif
+
+	/*
+	 * Parameter values aren't known until the first iteration, parallel
+	 * workers are only set up after this, and prefetch workers are started
+	 * once rows are wanted.
+	 */
+	if ((scan_state->param_exprs != NIL || plan->scan.plan.parallel_aware || lua_scan_prefetch(scan_state))
+		&& !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+	{
+		scan_state->start_pending = true;
+		return;
+	}
 
 	lua_pushboolean(scan_state->lua, eflags & EXEC_FLAG_EXPLAIN_ONLY ? 1:0);
 	lua_callback(scan_state->lua, "ScanStart", 1, 0);
+	scan_state->started = true;
 }
 
 static TupleTableSlot *
@@ -1029,15 +4832,6 @@ luaIterateForeignScan(ForeignScanState *node)
 {
 	LuaFdwScanState *scan_state;
 	TupleTableSlot *slot;
-	TupleDesc desc;
-	int i;
-	char *value;
-
-	Oid pgtype;
-	regproc typeinput;
-	HeapTuple tuple;
-	int typemod;
-	bool tuple_ok;
 
 	/*
 	 * Fetch one row from the foreign source, returning it in a tuple table
@@ -1065,53 +4859,43 @@ luaIterateForeignScan(ForeignScanState *node)
 	//elog(WARNING, "%s", __func__);
 
 	slot = node->ss.ss_ScanTupleSlot;
-	desc = slot->tts_tupleDescriptor;
-
-	memset (slot->tts_values, 0, sizeof(Datum) * desc->natts);
-	memset (slot->tts_isnull, true, sizeof(bool) * desc->natts);
-
-	ExecClearTuple(slot);
-
-	/* get the next record, if any, and fill in the slot */
-
 	scan_state = (LuaFdwScanState *) node->fdw_state;
 
-	if (lua_callback(scan_state->lua, "ScanIterate", 0, 1))
+	if (scan_state->start_pending)
 	{
-		if (lua_istable(scan_state->lua, -1))
-		{
-			for (i = 0; i < desc->natts; i++)
-			{
-				lua_pushstring(scan_state->lua, desc->attrs[i]->attname.data);
-				lua_gettable(scan_state->lua, -2);
-
-				slot->tts_isnull[i] = true;
+		scan_state->start_pending = false;
 
-				pgtype = desc->attrs[i]->atttypid;
-				tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(pgtype));
-				tuple_ok = HeapTupleIsValid(tuple);
-
-				if (!tuple_ok)
-				{
-					ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("cache lookup failed for type %u", pgtype)));
-				}
-				else
-				if (lua_isstring(scan_state->lua, -1) && (value = (char*)lua_tostring(scan_state->lua, -1)))
-				{
-					slot->tts_isnull[i] = false;
+		if (scan_state->param_exprs != NIL)
+			lua_params(node, scan_state);
 
-					typeinput = ((Form_pg_type)GETSTRUCT(tuple))->typinput;
-					typemod = ((Form_pg_type)GETSTRUCT(tuple))->typtypmod;
+#if PG_VERSION_NUM >= 90600
+		/* without a free worker slot, scan here after all */
+		if (scan_state->prefetch)
+			scan_state->prefetch = lua_prefetch_start(node, scan_state);
+#endif
 
-					slot->tts_values[i] = OidFunctionCall3(typeinput, CStringGetDatum(value), ObjectIdGetDatum(InvalidOid), Int32GetDatum(typemod));
-				}
-				lua_pop(scan_state->lua, 1);
-				ReleaseSysCache(tuple);
+		/* a prefetch worker calls ScanStart itself */
+		if (!lua_scan_prefetch(scan_state))
+		{
+			if (scan_state->started)
+				lua_callback(scan_state->lua, "ScanRestart", 0, 0);
+			else
+			{
+				lua_pushboolean(scan_state->lua, 0);
+				lua_callback(scan_state->lua, "ScanStart", 1, 0);
+				scan_state->started = true;
 			}
-			ExecStoreVirtualTuple(slot);
 		}
-		lua_pop(scan_state->lua, 1);
 	}
+
+	/* get the next record, if any, and fill in the slot */
+#if PG_VERSION_NUM >= 90600
+	if (scan_state->prefetch)
+		lua_prefetch_row(scan_state, slot);
+	else
+#endif
+	lua_scan_row(scan_state, slot);
+
 	return slot;
 }
 
@@ -1128,7 +4912,25 @@ luaReScanForeignScan(ForeignScanState *node)
 	 */
 
 	scan_state = (LuaFdwScanState *) node->fdw_state;
-	lua_callback(scan_state->lua, "ScanRestart", 0, 0);
+	lua_batch_reset(scan_state);
+
+	if (scan_state->running)
+		lua_coroutine_reset(scan_state);
+
+	/* shared counters are reset by luaReInitializeDSMForeignScan */
+	pg_atomic_write_u64(&scan_state->local.next_chunk, 0);
+	scan_state->rows_fetched = 0;
+
+#if PG_VERSION_NUM >= 90600
+	/* a fresh worker runs the scan again */
+	lua_prefetch_stop(scan_state);
+#endif
+
+	/* restart once new parameter values or parallel state are known */
+	if (scan_state->param_exprs != NIL || node->ss.ps.plan->parallel_aware || lua_scan_prefetch(scan_state))
+		scan_state->start_pending = true;
+	else
+		lua_callback(scan_state->lua, "ScanRestart", 0, 0);
 }
 
 static void
@@ -1144,15 +4946,288 @@ luaEndForeignScan(ForeignScanState *node)
 	 */
 
 	scan_state = (LuaFdwScanState *) node->fdw_state;
-	lua_callback(scan_state->lua, "ScanEnd", 0, 0);
+	lua_batch_reset(scan_state);
+
+#if PG_VERSION_NUM >= 90600
+	lua_prefetch_stop(scan_state);
+#endif
 
-	lua_stop(scan_state->lua);
+	if (scan_state->started)
+		lua_callback(scan_state->lua, "ScanEnd", 0, 0);
+
+	lua_scan_free(scan_state, node->ss.ss_ScanTupleSlot->tts_tupleDescriptor->natts);
+
+	lua_release(scan_state->lua);
 	node->fdw_state = NULL;
 }
 
+#if PG_VERSION_NUM >= 90600
+static bool
+luaIsForeignScanParallelSafe (PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
+{
+	DefElem *def;
+
+	/*
+	 * Only scripts that opt in: each worker runs its own copy of the script,
+	 * which must split the work with fdw.next_chunk() or see duplicate rows.
+	 */
+	def = lua_option(rte->relid, "parallel");
+
+	return def && defGetBoolean(def);
+}
+
+static Size
+luaEstimateDSMForeignScan (ForeignScanState *node, ParallelContext *pcxt)
+{
+	return sizeof(LuaFdwParallelState);
+}
+
+static void
+luaInitializeDSMForeignScan (ForeignScanState *node, ParallelContext *pcxt, void *coordinate)
+{
+	LuaFdwScanState *scan_state = (LuaFdwScanState *) node->fdw_state;
+	LuaFdwParallelState *shared = (LuaFdwParallelState *) coordinate;
+
+	pg_atomic_init_u64(&shared->next_chunk, 0);
+	shared->nworkers = pcxt->nworkers + 1;
+
+	scan_state->shared = shared;
+	lua_parallel_globals(scan_state, 0);
+}
+
+static void
+luaInitializeWorkerForeignScan (ForeignScanState *node, shm_toc *toc, void *coordinate)
+{
+	LuaFdwScanState *scan_state = (LuaFdwScanState *) node->fdw_state;
+
+	scan_state->shared = (LuaFdwParallelState *) coordinate;
+	lua_parallel_globals(scan_state, ParallelWorkerNumber + 1);
+}
+#endif
+
+#if PG_VERSION_NUM >= 100000
+static void
+luaReInitializeDSMForeignScan (ForeignScanState *node, ParallelContext *pcxt, void *coordinate)
+{
+	LuaFdwParallelState *shared = (LuaFdwParallelState *) coordinate;
+
+	pg_atomic_write_u64(&shared->next_chunk, 0);
+}
+#endif
+
+#if PG_VERSION_NUM >= 140000
+static bool
+luaIsForeignPathAsyncCapable (ForeignPath *path)
+{
+	LuaFdwPlanState *plan_state = (LuaFdwPlanState *) path->path.parent->fdw_private;
+
+	return plan_state->async_capable;
+}
+
+/*
+ * Fetch a row for Append, or leave the request pending while ScanIterate
+ * waits on its socket. ExecProcNode applies local quals and projection, and
+ * returns an empty slot both at the end of the scan and when suspended.
+ */
+static void
+lua_async_produce (AsyncRequest *areq)
+{
+	ForeignScanState *node = (ForeignScanState *) areq->requestee;
+	LuaFdwScanState *scan_state = (LuaFdwScanState *) node->fdw_state;
+	TupleTableSlot *result;
+
+	result = ExecProcNode((PlanState *) node);
+
+	if (TupIsNull(result) && scan_state->waiting)
+		ExecAsyncRequestPending(areq);
+	else
+		ExecAsyncRequestDone(areq, result);
+}
+
+static void
+luaForeignAsyncRequest (AsyncRequest *areq)
+{
+	lua_async_produce(areq);
+}
+
+static void
+luaForeignAsyncConfigureWait (AsyncRequest *areq)
+{
+	ForeignScanState *node = (ForeignScanState *) areq->requestee;
+	LuaFdwScanState *scan_state = (LuaFdwScanState *) node->fdw_state;
+	AppendState *requestor = (AppendState *) areq->requestor;
+
+	Assert(scan_state->waiting);
+
+	AddWaitEventToSet(requestor->as_eventset, scan_state->wait_events, scan_state->wait_fd, NULL, areq);
+}
+
+static void
+luaForeignAsyncNotify (AsyncRequest *areq)
+{
+	lua_async_produce(areq);
+}
+#endif
+
+/*
+ * Set up a Lua state and callbacks for writing to a foreign table.
+ */
+static LuaFdwModifyState*
+lua_modify_begin (ResultRelInfo *rinfo, CmdType operation)
+{
+	LuaFdwModifyState *modify_state;
+	Relation rel = rinfo->ri_RelationDesc;
+	TupleDesc desc = RelationGetDescr(rel);
+	Oid foreigntableid = RelationGetRelid(rel);
+	lua_State *lua;
+	DefElem *def;
+
+	modify_state = palloc0(sizeof(LuaFdwModifyState));
+	rinfo->ri_FdwState = modify_state;
+
+	lua = modify_state->lua = lua_table_acquire(foreigntableid);
+	modify_state->operation = operation;
+	modify_state->natts = desc->natts;
+	modify_state->columns = lua_columns(lua, desc, NIL);
+
+	/* no WHERE clauses, but scripts may expect the lists a scan gets */
+	lua_getglobal(lua, "fdw");
+	lua_describe(lua, foreigntableid, desc);
+	lua_clause_list(lua, desc, NIL);
+	lua_pop(lua, 1);
+
+	modify_state->insert_fn = lua_function_ref(lua, "Insert");
+	modify_state->insert_batch_fn = lua_function_ref(lua, "InsertBatch");
+	modify_state->update_fn = lua_function_ref(lua, "Update");
+	modify_state->delete_fn = lua_function_ref(lua, "Delete");
+
+	def = lua_option(foreigntableid, "batch_size");
+	modify_state->batch_size = def ? lua_option_int(def, 1) : 100;
+
+	if ((operation == CMD_INSERT && modify_state->insert_fn == LUA_NOREF && modify_state->insert_batch_fn == LUA_NOREF)
+		|| (operation == CMD_UPDATE && modify_state->update_fn == LUA_NOREF)
+		|| (operation == CMD_DELETE && modify_state->delete_fn == LUA_NOREF))
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+				errmsg("lua_fdw: script for \"%s\" does not define %s", RelationGetRelationName(rel),
+					operation == CMD_INSERT ? "Insert or InsertBatch" :
+					operation == CMD_UPDATE ? "Update" : "Delete")));
+
+	return modify_state;
+}
+
+static void
+lua_modify_start (LuaFdwModifyState *modify_state)
+{
+	lua_pushstring(modify_state->lua,
+		modify_state->operation == CMD_INSERT ? "insert" :
+		modify_state->operation == CMD_UPDATE ? "update" : "delete");
+
+	lua_callback(modify_state->lua, "ModifyStart", 1, 0);
+	modify_state->started = true;
+}
+
+/*
+ * True when rows can't be deferred because RETURNING, a view's CHECK
+ * OPTION or a row trigger looks at each one as it is inserted.
+ */
+static bool
+lua_insert_one_at_a_time (ResultRelInfo *rinfo)
+{
+	return rinfo->ri_projectReturning != NULL
+		|| rinfo->ri_WithCheckOptions != NIL
+		|| (rinfo->ri_TrigDesc
+			&& (rinfo->ri_TrigDesc->trig_insert_before_row || rinfo->ri_TrigDesc->trig_insert_after_row));
+}
+
+/*
+ * Hand the buffered chunk to InsertBatch(rows) and free it.
+ */
+static void
+lua_chunk_flush (LuaFdwModifyState *modify_state, TupleDesc desc)
+{
+	lua_State *lua = modify_state->lua;
+	MemoryContext oldcontext;
+	Datum *values;
+	bool *isnull;
+	int i;
+
+	if (modify_state->chunk_len == 0)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(modify_state->chunk_cxt);
+
+	values = palloc(sizeof(Datum) * desc->natts);
+	isnull = palloc(sizeof(bool) * desc->natts);
+
+	lua_createtable(lua, modify_state->chunk_len, 0);
+
+	for (i = 0; i < modify_state->chunk_len; i++)
+	{
+		heap_deform_tuple(modify_state->chunk[i], desc, values, isnull);
+		lua_values_to_row(lua, desc->natts, values, isnull, modify_state->columns);
+		lua_rawseti(lua, -2, i + 1);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	modify_state->chunk_len = 0;
+	MemoryContextReset(modify_state->chunk_cxt);
+
+	lua_callback_ref(lua, modify_state->insert_batch_fn, 1, 0);
+}
+
+static void
+lua_modify_end (LuaFdwModifyState *modify_state, TupleDesc desc)
+{
+	lua_State *lua = modify_state->lua;
+
+	if (modify_state->chunk_cxt)
+	{
+		lua_chunk_flush(modify_state, desc);
+		MemoryContextDelete(modify_state->chunk_cxt);
+		modify_state->chunk_cxt = NULL;
+	}
+
+	if (modify_state->started)
+		lua_callback(lua, "ModifyEnd", 0, 0);
+
+	luaL_unref(lua, LUA_REGISTRYINDEX, modify_state->insert_fn);
+	luaL_unref(lua, LUA_REGISTRYINDEX, modify_state->insert_batch_fn);
+	luaL_unref(lua, LUA_REGISTRYINDEX, modify_state->update_fn);
+	luaL_unref(lua, LUA_REGISTRYINDEX, modify_state->delete_fn);
+	lua_columns_free(lua, modify_state->columns, modify_state->natts);
+
+	lua_release(lua);
+}
+
+/*
+ * Push the old row of an UPDATE or DELETE from its whole-row junk column.
+ */
+static void
+lua_push_oldrow (LuaFdwModifyState *modify_state, ResultRelInfo *rinfo, TupleTableSlot *planSlot)
+{
+	Datum record;
+	bool isnull;
+
+	record = ExecGetJunkAttribute(planSlot, modify_state->oldrow_attno, &isnull);
+
+	if (isnull)
+		elog(ERROR, "%s is NULL", LUA_FDW_OLDROW);
+
+	lua_record_to_row(modify_state->lua, record, RelationGetDescr(rinfo->ri_RelationDesc), modify_state->columns);
+}
+
+#if PG_VERSION_NUM >= 140000
+static void
+luaAddForeignUpdateTargets(PlannerInfo *root, Index rtindex, RangeTblEntry *target_rte, Relation target_relation)
+#else
 static void
 luaAddForeignUpdateTargets(Query *parsetree, RangeTblEntry *target_rte, Relation target_relation)
+#endif
 {
+	Var *var;
+
 	/*
 	 * UPDATE and DELETE operations are performed against rows previously
 	 * fetched by the table-scanning functions. The FDW may need extra
@@ -1182,12 +5257,18 @@ luaAddForeignUpdateTargets(Query *parsetree, RangeTblEntry *target_rte, Relation
 
 	//elog(WARNING, "%s", __func__);
 
-//	lua_getglobal(lua, "AddForeignUpdateTargets");
-//
-//	if (lua_isfunction(lua, -1) && lua_pcall(lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "AddForeignUpdateTargets: %s", lua_tostring(lua, -1));
-//	}
+	/*
+	 * Scripts have no row ID of their own, so fetch the whole old row and
+	 * let Update(old, new) and Delete(old) identify it.
+	 */
+#if PG_VERSION_NUM >= 140000
+	var = makeWholeRowVar(target_rte, rtindex, 0, false);
+	add_row_identity_var(root, var, rtindex, LUA_FDW_OLDROW);
+#else
+	var = makeWholeRowVar(target_rte, parsetree->resultRelation, 0, false);
+	parsetree->targetList = lappend(parsetree->targetList,
+		makeTargetEntry((Expr *) var, list_length(parsetree->targetList) + 1, pstrdup(LUA_FDW_OLDROW), true));
+#endif
 }
 
 static List *
@@ -1228,7 +5309,9 @@ luaPlanForeignModify(PlannerInfo *root, ModifyTable *plan, Index resultRelation,
 static void
 luaBeginForeignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo, List *fdw_private, int subplan_index, int eflags)
 {
-	//LuaFdwModifyState *modify_state;
+	LuaFdwModifyState *modify_state;
+	Relation rel = rinfo->ri_RelationDesc;
+	Plan *subplan;
 
 	/*
 	 * Begin executing a foreign table modification operation. This routine is
@@ -1257,22 +5340,30 @@ luaBeginForeignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo, List *fdw
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	modify_state = palloc0(sizeof(LuaFdwModifyState));
-//	rinfo->ri_FdwState = modify_state;
-//	modify_state->lua = lua_start(NULL, NULL);
+	modify_state = lua_modify_begin(rinfo, mtstate->operation);
 
-//	lua_getglobal(modify_state->lua, "BeginForeignModify");
-//
-//	if (lua_isfunction(modify_state->lua, -1) && lua_pcall(modify_state->lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "BeginForeignModify: %s", lua_tostring(modify_state->lua, -1));
-//	}
+	if (modify_state->operation == CMD_UPDATE || modify_state->operation == CMD_DELETE)
+	{
+#if PG_VERSION_NUM >= 140000
+		subplan = outerPlanState(mtstate)->plan;
+#else
+		subplan = mtstate->mt_plans[subplan_index]->plan;
+#endif
+		modify_state->oldrow_attno = ExecFindJunkAttributeInTlist(subplan->targetlist, LUA_FDW_OLDROW);
+
+		if (!AttributeNumberIsValid(modify_state->oldrow_attno))
+			elog(ERROR, "could not find junk %s column for %s", LUA_FDW_OLDROW, RelationGetRelationName(rel));
+	}
+
+	if (!(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+		lua_modify_start(modify_state);
 }
 
 static TupleTableSlot *
 luaExecForeignInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot, TupleTableSlot *planSlot)
 {
-	//LuaFdwModifyState *modify_state;
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
+	lua_State *lua = modify_state->lua;
 
 	/*
 	 * Insert one tuple into the foreign table. estate is global execution
@@ -1302,13 +5393,34 @@ luaExecForeignInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
-//	lua_getglobal(modify_state->lua, "ExecForeignInsert");
-//
-//	if (lua_isfunction(modify_state->lua, -1) && lua_pcall(modify_state->lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "ExecForeignInsert: %s", lua_tostring(modify_state->lua, -1));
-//	}
+	if (modify_state->chunk_cxt)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(modify_state->chunk_cxt);
+#if PG_VERSION_NUM >= 120000
+		modify_state->chunk[modify_state->chunk_len++] = ExecCopySlotHeapTuple(slot);
+#else
+		modify_state->chunk[modify_state->chunk_len++] = ExecCopySlotTuple(slot);
+#endif
+		MemoryContextSwitchTo(oldcontext);
+
+		if (modify_state->chunk_len == modify_state->chunk_size)
+			lua_chunk_flush(modify_state, slot->tts_tupleDescriptor);
+
+		return slot;
+	}
+
+	lua_slot_to_row(lua, slot, modify_state->columns);
+
+	if (modify_state->insert_fn != LUA_NOREF)
+		lua_callback_ref(lua, modify_state->insert_fn, 1, 0);
+	else
+	{
+		/* InsertBatch({row}) */
+		lua_createtable(lua, 1, 0);
+		lua_insert(lua, -2);
+		lua_rawseti(lua, -2, 1);
+		lua_callback_ref(lua, modify_state->insert_batch_fn, 1, 0);
+	}
 
 	return slot;
 }
@@ -1316,7 +5428,8 @@ luaExecForeignInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
 static TupleTableSlot *
 luaExecForeignUpdate(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot, TupleTableSlot *planSlot)
 {
-	//LuaFdwModifyState *modify_state;
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
+	lua_State *lua = modify_state->lua;
 
 	/*
 	 * Update one tuple in the foreign table. estate is global execution state
@@ -1346,13 +5459,9 @@ luaExecForeignUpdate(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
-//	lua_getglobal(modify_state->lua, "ExecForeignUpdate");
-//
-//	if (lua_isfunction(modify_state->lua, -1) && lua_pcall(modify_state->lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "ExecForeignUpdate: %s", lua_tostring(modify_state->lua, -1));
-//	}
+	lua_push_oldrow(modify_state, rinfo, planSlot);
+	lua_slot_to_row(lua, slot, modify_state->columns);
+	lua_callback_ref(lua, modify_state->update_fn, 2, 0);
 
 	return slot;
 }
@@ -1360,7 +5469,7 @@ luaExecForeignUpdate(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
 static TupleTableSlot *
 luaExecForeignDelete(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot, TupleTableSlot *planSlot)
 {
-	//LuaFdwModifyState *modify_state;
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
 
 	/*
 	 * Delete one tuple from the foreign table. estate is global execution
@@ -1386,20 +5495,10 @@ luaExecForeignDelete(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
 	 * from the foreign table will fail with an error message.
 	 */
 
-	/* ----
-	 * LuaFdwModifyState *modify_state =
-	 *	 (LuaFdwModifyState *) rinfo->ri_FdwState;
-	 * ----
-	 */
 	//elog(WARNING, "%s", __func__);
 
-//	modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
-//	lua_getglobal(modify_state->lua, "ExecForeignDelete");
-//
-//	if (lua_isfunction(modify_state->lua, -1) && lua_pcall(modify_state->lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "ExecForeignDelete: %s", lua_tostring(modify_state->lua, -1));
-//	}
+	lua_push_oldrow(modify_state, rinfo, planSlot);
+	lua_callback_ref(modify_state->lua, modify_state->delete_fn, 1, 0);
 
 	return slot;
 }
@@ -1408,7 +5507,7 @@ luaExecForeignDelete(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
 static void
 luaEndForeignModify(EState *estate, ResultRelInfo *rinfo)
 {
-	//LuaFdwModifyState *modify_state;
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
 
 	/*
 	 * End the table update and release resources. It is normally not
@@ -1420,15 +5519,100 @@ luaEndForeignModify(EState *estate, ResultRelInfo *rinfo)
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
-//	lua_getglobal(modify_state->lua, "EndForeignModify");
-//
-//	if (lua_isfunction(modify_state->lua, -1) && lua_pcall(modify_state->lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "EndForeignModify: %s", lua_tostring(modify_state->lua, -1));
-//	}
+	if (modify_state == NULL)
+		return;
+
+	lua_modify_end(modify_state, RelationGetDescr(rinfo->ri_RelationDesc));
+	rinfo->ri_FdwState = NULL;
+}
+
+#if PG_VERSION_NUM >= 110000
+static void
+luaBeginForeignInsert(ModifyTableState *mtstate, ResultRelInfo *rinfo)
+{
+	LuaFdwModifyState *modify_state;
+	DefElem *def;
+
+	/*
+	 * Begin executing an insert operation on a foreign table. This routine is
+	 * called right before the first tuple is inserted into the foreign table
+	 * in both cases when it is the partition chosen for tuple routing and the
+	 * target specified in a COPY FROM command.
+	 */
+	//elog(WARNING, "%s", __func__);
+
+	modify_state = lua_modify_begin(rinfo, CMD_INSERT);
+
+	/*
+	 * Bulk loads go through here, so collect rows in C and pass large arrays
+	 * to the script, resetting the chunk's memory each time.
+	 */
+	if (modify_state->insert_batch_fn != LUA_NOREF && !lua_insert_one_at_a_time(rinfo))
+	{
+		def = lua_option(RelationGetRelid(rinfo->ri_RelationDesc), "copy_batch_size");
+		modify_state->chunk_size = def ? lua_option_int(def, 1) : 10000;
+		modify_state->chunk = palloc(sizeof(HeapTuple) * modify_state->chunk_size);
+		modify_state->chunk_cxt = AllocSetContextCreate(CurrentMemoryContext, "lua_fdw insert chunk", ALLOCSET_DEFAULT_SIZES);
+	}
+
+	lua_modify_start(modify_state);
 }
 
+static void
+luaEndForeignInsert(EState *estate, ResultRelInfo *rinfo)
+{
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
+
+	/*
+	 * End the insert operation and release resources.
+	 */
+	//elog(WARNING, "%s", __func__);
+
+	if (modify_state == NULL)
+		return;
+
+	lua_modify_end(modify_state, RelationGetDescr(rinfo->ri_RelationDesc));
+	rinfo->ri_FdwState = NULL;
+}
+#endif
+
+#if PG_VERSION_NUM >= 140000
+static TupleTableSlot **
+luaExecForeignBatchInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot **slots, TupleTableSlot **planSlots, int *numSlots)
+{
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
+	lua_State *lua = modify_state->lua;
+	int i;
+
+	lua_createtable(lua, *numSlots, 0);
+
+	for (i = 0; i < *numSlots; i++)
+	{
+		lua_slot_to_row(lua, slots[i], modify_state->columns);
+		lua_rawseti(lua, -2, i + 1);
+	}
+
+	lua_callback_ref(lua, modify_state->insert_batch_fn, 1, 0);
+
+	return slots;
+}
+
+static int
+luaGetForeignModifyBatchSize(ResultRelInfo *rinfo)
+{
+	LuaFdwModifyState *modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
+
+	/* COPY and routed inserts buffer their own, larger chunks */
+	if (modify_state == NULL || modify_state->insert_batch_fn == LUA_NOREF || modify_state->chunk_cxt)
+		return 1;
+
+	if (lua_insert_one_at_a_time(rinfo))
+		return 1;
+
+	return modify_state->batch_size;
+}
+#endif
+
 static int
 luaIsForeignRelUpdatable(Relation rel)
 {
@@ -1484,7 +5668,7 @@ luaExplainForeignScan (ForeignScanState *node, struct ExplainState * es)
 
 	if (lua_isfunction(scan_state->lua, -1))
 	{
-		if (lua_pcall(scan_state->lua, 0, 1, 0) != 0)
+		if (lua_pcall_limited(scan_state->lua, 0, 1) != 0)
 			ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(scan_state->lua, -1))));
 		else
 		{
@@ -1499,7 +5683,7 @@ luaExplainForeignScan (ForeignScanState *node, struct ExplainState * es)
 static void
 luaExplainForeignModify (ModifyTableState *mtstate, ResultRelInfo *rinfo, List *fdw_private, int subplan_index, struct ExplainState * es)
 {
-	//LuaFdwModifyState *modify_state;
+	LuaFdwModifyState *modify_state;
 
 	/*
 	 * Print additional EXPLAIN output for a foreign table update. This
@@ -1514,21 +5698,214 @@ luaExplainForeignModify (ModifyTableState *mtstate, ResultRelInfo *rinfo, List *
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
-//	lua_getglobal(modify_state->lua, "ExplainForeignModify");
-//
-//	if (lua_isfunction(modify_state->lua, -1))
-//	{
-//		if (lua_pcall(modify_state->lua, 0, 1, 0) != 0)
-//			ereport(ERROR, (errcode(ERRCODE_FDW_ERROR), errmsg("lua_fdw lua error: %s", lua_tostring(modify_state->lua, -1))));
-//		else
-//		{
-//			if (lua_isstring(modify_state->lua, -1))
-//				ExplainPropertyText("lua_fdw", lua_tostring(modify_state->lua, -1), es);
-//
-//			lua_pop(modify_state->lua, 1);
-//		}
-//	}
+	modify_state = (LuaFdwModifyState *) rinfo->ri_FdwState;
+
+	if (lua_callback(modify_state->lua, "ModifyExplain", 0, 1))
+	{
+		if (lua_isstring(modify_state->lua, -1))
+			ExplainPropertyText("lua_fdw", lua_tostring(modify_state->lua, -1), es);
+
+		lua_pop(modify_state->lua, 1);
+	}
+
+#if PG_VERSION_NUM >= 140000
+	if (es->verbose && rinfo->ri_BatchSize > 1)
+		ExplainPropertyInteger("Batch Size", NULL, rinfo->ri_BatchSize, es);
+#endif
+}
+
+/*
+ * Reservoir sampling state for lua_acquire_sample_rows, Vitter's algorithm
+ * as in file_fdw and the core's own block sampler.
+ */
+typedef struct
+{
+	HeapTuple *rows;
+	int targrows;
+	int numrows;
+	double samplerows;
+	double rowstoskip;
+	ReservoirStateData rstate;
+} LuaFdwSample;
+
+static void
+lua_sample_add (LuaFdwSample *sample, TupleTableSlot *slot)
+{
+	HeapTuple tuple;
+	int k;
+
+	vacuum_delay_point();
+
+	if (sample->numrows < sample->targrows)
+	{
+		sample->rows[sample->numrows++] = heap_form_tuple(slot->tts_tupleDescriptor, slot->tts_values, slot->tts_isnull);
+	}
+	else
+	{
+		/*
+		 * t in Vitter's paper is the number of records already processed.
+		 * If we need to compute a new S value, we must use the "not yet
+		 * incremented" value of samplerows as t.
+		 */
+		if (sample->rowstoskip < 0)
+			sample->rowstoskip = reservoir_get_next_S(&sample->rstate, sample->samplerows, sample->targrows);
+
+		if (sample->rowstoskip <= 0)
+		{
+#if PG_VERSION_NUM >= 150000
+			k = (int) (sample->targrows * sampler_random_fract(&sample->rstate.randstate));
+#else
+			k = (int) (sample->targrows * sampler_random_fract(sample->rstate.randstate));
+#endif
+			tuple = heap_form_tuple(slot->tts_tupleDescriptor, slot->tts_values, slot->tts_isnull);
+
+			heap_freetuple(sample->rows[k]);
+			sample->rows[k] = tuple;
+		}
+
+		sample->rowstoskip -= 1;
+	}
+
+	sample->samplerows += 1;
+}
+
+/*
+ * AcquireSampleRowsFunc: sample rows from AnalyzeSample(targrows) if the
+ * script defines it, otherwise from a full scan. Either way the rows pass
+ * through a reservoir here, so scripts may return more than asked for.
+ */
+static int
+lua_acquire_sample_rows (Relation relation, int elevel, HeapTuple *rows, int targrows, double *totalrows, double *totaldeadrows)
+{
+	Oid foreigntableid = RelationGetRelid(relation);
+	TupleDesc desc = RelationGetDescr(relation);
+	LuaFdwScanState *scan_state;
+	LuaFdwSample sample;
+	TupleTableSlot *slot;
+	MemoryContext tupcontext, oldcontext;
+	List *attrs = NIL;
+	lua_State *lua;
+	double estimate = -1;
+	bool partial = false;
+	int i, n;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		if (!TupleDescAttr(desc, i)->attisdropped)
+			attrs = lappend_int(attrs, i + 1);
+	}
+
+	memset(&sample, 0, sizeof(sample));
+	sample.rows = rows;
+	sample.targrows = targrows;
+	sample.rowstoskip = -1;
+	reservoir_init_selection_state(&sample.rstate, targrows);
+
+	scan_state = palloc0(sizeof(LuaFdwScanState));
+	lua = scan_state->lua = lua_table_acquire(foreigntableid);
+	scan_state->columns = lua_columns(lua, desc, attrs);
+
+	/* a scan of the whole table, with empty fdw.clauses and fdw.quals */
+	lua_getglobal(lua, "fdw");
+	lua_describe(lua, foreigntableid, desc);
+	lua_target(lua, desc, attrs);
+	lua_clause_list(lua, desc, NIL);
+	lua_pop(lua, 1);
+
+	lua_scan_init(scan_state, foreigntableid);
+
+#if PG_VERSION_NUM >= 120000
+	slot = MakeSingleTupleTableSlot(desc, &TTSOpsVirtual);
+#else
+	slot = MakeSingleTupleTableSlot(desc);
+#endif
+
+	/* conversions happen here, sampled tuples are formed in the caller's */
+	tupcontext = AllocSetContextCreate(CurrentMemoryContext, "lua_fdw analyze", ALLOCSET_DEFAULT_SIZES);
+
+	lua_pushinteger(lua, targrows);
+
+	if (lua_callback(lua, "AnalyzeSample", 1, 2))
+	{
+		partial = true;
+
+		if (lua_isnumber(lua, -1))
+			estimate = lua_tonumber(lua, -1);
+
+		lua_pop(lua, 1);
+
+		n = lua_istable(lua, -1) ? lua_rawlen(lua, -1) : 0;
+
+		for (i = 1; i <= n; i++)
+		{
+			MemoryContextReset(tupcontext);
+			oldcontext = MemoryContextSwitchTo(tupcontext);
+
+			memset (slot->tts_values, 0, sizeof(Datum) * desc->natts);
+			memset (slot->tts_isnull, true, sizeof(bool) * desc->natts);
+			ExecClearTuple(slot);
+
+			lua_rawgeti(lua, -1, i);
+
+			if (lua_istable(lua, -1))
+				lua_row_to_slot(lua, slot, scan_state->columns);
+
+			lua_pop(lua, 1);
+
+			MemoryContextSwitchTo(oldcontext);
+
+			if (!TupIsNull(slot))
+				lua_sample_add(&sample, slot);
+		}
+
+		lua_pop(lua, 1);
+	}
+	else
+	{
+		lua_pushboolean(lua, 0);
+		lua_callback(lua, "ScanStart", 1, 0);
+
+		for (;;)
+		{
+			MemoryContextReset(tupcontext);
+			oldcontext = MemoryContextSwitchTo(tupcontext);
+
+			lua_scan_row(scan_state, slot);
+
+			MemoryContextSwitchTo(oldcontext);
+
+			if (TupIsNull(slot))
+				break;
+
+			lua_sample_add(&sample, slot);
+		}
+
+		lua_callback(lua, "ScanEnd", 0, 0);
+	}
+
+	/* a sample only knows the table size if the script says */
+	if (partial && estimate < 0 && lua_callback(lua, "EstimateRowCount", 0, 1))
+	{
+		if (lua_isnumber(lua, -1))
+			estimate = lua_tonumber(lua, -1);
+
+		lua_pop(lua, 1);
+	}
+
+	*totalrows = estimate >= 0 ? estimate : sample.samplerows;
+	*totaldeadrows = 0;
+
+	ExecDropSingleTupleTableSlot(slot);
+	MemoryContextDelete(tupcontext);
+
+	lua_scan_free(scan_state, desc->natts);
+	lua_release(lua);
+
+	ereport(elevel,
+		(errmsg("\"%s\": lua_fdw returned %.0f rows, estimated %.0f total; %d rows in sample",
+			RelationGetRelationName(relation), sample.samplerows, *totalrows, sample.numrows)));
+
+	return sample.numrows;
 }
 
 static bool
@@ -1562,14 +5939,10 @@ luaAnalyzeForeignTable(Relation relation, AcquireSampleRowsFunc *func, BlockNumb
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	lua_getglobal(lua, "AnalyzeForeignTable");
-//
-//	if (lua_isfunction(lua, -1) && lua_pcall(lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "AnalyzeForeignTable: %s", lua_tostring(lua, -1));
-//	}
+	*func = lua_acquire_sample_rows;
+	*totalpages = 1;
 
-	return false;
+	return true;
 }
 
 static void
@@ -1606,15 +5979,201 @@ luaGetForeignJoinPaths (PlannerInfo *root, RelOptInfo *joinrel, RelOptInfo *oute
 	 */
 	//elog(WARNING, "%s", __func__);
 
-//	lua_getglobal(lua, "GetForeignJoinPaths");
-//
-//	if (lua_isfunction(lua, -1) && lua_pcall(lua, 0, 0, 0) != 0)
-//	{
-//		elog(ERROR, "GetForeignJoinPaths: %s", lua_tostring(lua, -1));
-//	}
+#if PG_VERSION_NUM >= 90600
+	LuaFdwPlanState *plan_state;
+	RangeTblEntry *outer_rte, *inner_rte;
+	lua_State *lua;
+	ListCell *lc;
+	Var *outer, *inner;
+	List *quals;
+	double rows;
+	Cost startup_cost, total_cost;
+	bool defined;
+	int i;
+
+	/* first pair of inputs only */
+	if (joinrel->fdw_private)
+		return;
+
+	plan_state = palloc0(sizeof(LuaFdwPlanState));
+	joinrel->fdw_private = plan_state;
+
+	/*
+	 * Inner joins of two tables, where every join clause can be checked
+	 * again on the joined rows. Row locking and UPDATE/DELETE would need an
+	 * EvalPlanQual path, so leave those to local joins.
+	 */
+	if (jointype != JOIN_INNER
+		|| outerrel->reloptkind != RELOPT_BASEREL
+		|| innerrel->reloptkind != RELOPT_BASEREL
+		|| root->parse->commandType != CMD_SELECT
+		|| root->rowMarks != NIL
+		|| !bms_is_empty(joinrel->lateral_relids))
+		return;
+
+	outer_rte = planner_rt_fetch(outerrel->relid, root);
+	inner_rte = planner_rt_fetch(innerrel->relid, root);
+
+	if (!lua_same_script(outer_rte->relid, inner_rte->relid))
+		return;
+
+	lua = ((LuaFdwPlanState *) outerrel->fdw_private)->lua;
+
+	lua_getglobal(lua, "PlanJoin");
+	defined = lua_isfunction(lua, -1);
+	lua_pop(lua, 1);
+
+	if (!defined)
+		return;
+
+	/*
+	 * The member scans won't run, so their own restrictions are checked on
+	 * the joined rows along with the join clauses.
+	 */
+	foreach(lc, extra->restrictlist)
+	{
+		if (((RestrictInfo *) lfirst(lc))->pseudoconstant)
+			return;
+	}
+
+	foreach(lc, outerrel->baserestrictinfo)
+	{
+		if (((RestrictInfo *) lfirst(lc))->pseudoconstant)
+			return;
+	}
+
+	foreach(lc, innerrel->baserestrictinfo)
+	{
+		if (((RestrictInfo *) lfirst(lc))->pseudoconstant)
+			return;
+	}
+
+	quals = extract_actual_clauses(extra->restrictlist, false);
+	quals = list_concat(quals, extract_actual_clauses(outerrel->baserestrictinfo, false));
+	quals = list_concat(quals, extract_actual_clauses(innerrel->baserestrictinfo, false));
+
+	if (!lua_join_vars(joinrel->reltarget->exprs, quals, &plan_state->join_vars))
+		return;
+
+	plan_state->lua = lua;
+	plan_state->outerrel = outerrel;
+	plan_state->innerrel = innerrel;
+	plan_state->join_quals = quals;
+
+	/* PlanJoin(outer, inner, jointype, join_clauses) */
+	lua_join_side(lua, root, outerrel);
+	lua_join_side(lua, root, innerrel);
+	lua_pushstring(lua, "inner");
+	lua_createtable(lua, 0, 0);
+	i = 1;
+
+	foreach(lc, extra->restrictlist)
+	{
+		char *outer_name, *inner_name;
+
+		if (!lua_join_clause((RestrictInfo *) lfirst(lc), outerrel, innerrel, &outer, &inner))
+			continue;
+
+		outer_name = lua_attname(outer_rte->relid, outer->varattno);
+		inner_name = lua_attname(inner_rte->relid, inner->varattno);
+
+		plan_state->join_clauses = lappend(plan_state->join_clauses,
+			list_make3(makeString(outer_name), makeString(pstrdup("eq")), makeString(inner_name)));
+
+		lua_createtable(lua, 0, 3);
+
+		lua_pushstring(lua, "outer");
+		lua_pushstring(lua, outer_name);
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "operator");
+		lua_pushstring(lua, "eq");
+		lua_settable(lua, -3);
+
+		lua_pushstring(lua, "inner");
+		lua_pushstring(lua, inner_name);
+		lua_settable(lua, -3);
+
+		lua_rawseti(lua, -2, i++);
+	}
+
+	rows = joinrel->rows;
+	startup_cost = 0;
+	total_cost = startup_cost + rows;
+
+	if (!lua_callback(lua, "PlanJoin", 4, 4))
+		return;
+
+	if (!lua_toboolean(lua, -4))
+	{
+		lua_pop(lua, 4);
+		return;
+	}
+
+	if (lua_isnumber(lua, -3))
+		rows = lua_tonumber(lua, -3);
+
+	if (lua_isnumber(lua, -2))
+		startup_cost = lua_tonumber(lua, -2);
+
+	if (lua_isnumber(lua, -1))
+		total_cost = lua_tonumber(lua, -1);
+
+	lua_pop(lua, 4);
+
+	add_path(joinrel, (Path *)
+#if PG_VERSION_NUM >= 120000
+			 create_foreign_join_path(root, joinrel,
+#else
+			 create_foreignscan_path(root, joinrel,
+#endif
+									 NULL,      /* default pathtarget */
+									 rows,
+									 startup_cost,
+									 total_cost,
+									 NIL,		/* no pathkeys */
+									 joinrel->lateral_relids,
+									 NULL,      /* no extra plan */
+									 NIL));		/* no fdw_private data */
+#endif
 }
 
 
+#if PG_VERSION_NUM >= 110000
+static void
+luaGetForeignUpperPaths (PlannerInfo *root, UpperRelationKind stage, RelOptInfo *input_rel, RelOptInfo *output_rel, void *extra)
+#elif PG_VERSION_NUM >= 100000
+static void
+luaGetForeignUpperPaths (PlannerInfo *root, UpperRelationKind stage, RelOptInfo *input_rel, RelOptInfo *output_rel)
+#endif
+#if PG_VERSION_NUM >= 100000
+{
+	/*
+	 * Create possible access paths for upper relation processing, which is
+	 * the planner's term for all post-scan/join query processing, such as
+	 * aggregation, window functions, sorting, and table updates. This
+	 * optional function is called during query planning. Currently, it is
+	 * called only if all base relation(s) involved in the query belong to
+	 * the same FDW. This function should generate ForeignPath path(s) for any
+	 * post-scan/join processing that the FDW knows how to perform remotely,
+	 * and call add_path to add these paths to the indicated upper relation.
+	 * As with GetForeignJoinPaths, it is not necessary that this function
+	 * succeed in creating any paths, since paths involving local processing
+	 * are always possible.
+	 */
+	//elog(WARNING, "%s", __func__);
+
+	if (output_rel->fdw_private)
+		return;
+
+	if (stage == UPPERREL_GROUP_AGG)
+		lua_aggregate_paths(root, input_rel, output_rel);
+
+	if (stage == UPPERREL_FINAL)
+		lua_limit_paths(root);
+}
+#endif
+
 static RowMarkType
 luaGetForeignRowMarkType (RangeTblEntry *rte, LockClauseStrength strength)
 {
@@ -1644,8 +6203,13 @@ luaGetForeignRowMarkType (RangeTblEntry *rte, LockClauseStrength strength)
 	return ROW_MARK_COPY;
 }
 
+#if PG_VERSION_NUM >= 120000
+static void
+luaRefetchForeignRow(EState *estate, ExecRowMark *erm, Datum rowid, TupleTableSlot *slot, bool *updated)
+#else
 static HeapTuple
 luaRefetchForeignRow(EState *estate, ExecRowMark *erm, Datum rowid, bool *updated)
+#endif
 {
 	/*
 	 * Re-fetch one tuple from the foreign table, after locking it if
@@ -1687,8 +6251,11 @@ luaRefetchForeignRow(EState *estate, ExecRowMark *erm, Datum rowid, bool *update
 //		elog(ERROR, "RefetchForeignRow: %s", lua_tostring(lua, -1));
 //	}
 
+#if PG_VERSION_NUM >= 120000
+	ExecClearTuple(slot);
+#else
 	return NULL;
-
+#endif
 }
 
 static List *
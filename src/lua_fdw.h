@@ -0,0 +1,172 @@
+/*-------------------------------------------------------------------------
+ *
+ * Lua Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2016 Sean Pringle (lua_fdw)
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Andrew Dunstan <andrew@dunslane.net> (blackhole_fdw)
+ * Author: Sean Pringle <sean.pringle@gmail.com> (lua_fdw)
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef LUA_FDW_H
+#define LUA_FDW_H
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#if LUA_VERSION_NUM < 502
+#define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+#define lua_rawlen(L, i) lua_objlen(L, i)
+#endif
+
+/* lua_fdw.c */
+
+int
+lua_callback (
+	lua_State *lua,
+	const char *func,
+	int args,
+	int results
+);
+
+int
+lua_function_ref (
+	lua_State *lua,
+	const char *func
+);
+
+int
+lua_callback_ref (
+	lua_State *lua,
+	int ref,
+	int args,
+	int results
+);
+
+lua_State*
+lua_start (
+	const char *script,
+	const char *inject,
+	const char *lua_path,
+	const char *lua_cpath
+);
+
+void
+lua_globals (
+	lua_State *lua
+);
+
+void
+lua_stop (
+	lua_State *lua
+);
+
+int
+lua_ereport (
+	lua_State *lua
+);
+
+/* pool.c */
+
+extern int lua_fdw_pool_size;
+
+void
+lua_pool_init (void);
+
+lua_State*
+lua_acquire (
+	const char *script,
+	const char *inject,
+	const char *lua_path,
+	const char *lua_cpath
+);
+
+void
+lua_release (
+	lua_State *lua
+);
+
+void
+lua_discard (
+	lua_State *lua
+);
+
+/* alloc.c */
+
+extern int lua_fdw_memory_limit;
+
+void
+lua_alloc_init (void);
+
+lua_State*
+lua_newstate_context (void);
+
+void
+lua_close_context (
+	lua_State *lua
+);
+
+Size
+lua_memory_used (
+	lua_State *lua
+);
+
+void
+lua_limit_begin (
+	lua_State *lua
+);
+
+void
+lua_limit_end (
+	lua_State *lua
+);
+
+int
+lua_pcall_limited (
+	lua_State *lua,
+	int args,
+	int results
+);
+
+bool
+lua_panicked (
+	lua_State *lua
+);
+
+/* csv.c */
+
+void
+lua_csv_push (
+	lua_State *lua
+);
+
+/* socket.c */
+
+void
+lua_socket_push (
+	lua_State *lua
+);
+
+/* cache.c */
+
+void
+lua_cache_init (void);
+
+int
+lua_loadfile_cached (
+	lua_State *lua,
+	const char *path
+);
+
+int
+lua_loadstring_cached (
+	lua_State *lua,
+	const char *text
+);
+
+#endif /* LUA_FDW_H */
@@ -0,0 +1,445 @@
+/*-------------------------------------------------------------------------
+ *
+ * Lua Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2016 Sean Pringle (lua_fdw)
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Andrew Dunstan <andrew@dunslane.net> (blackhole_fdw)
+ * Author: Sean Pringle <sean.pringle@gmail.com> (lua_fdw)
+ *
+ *-------------------------------------------------------------------------
+ *
+ * Backend-local pool of warm Lua states.
+ *
+ * Starting a state means luaL_openlibs, loading the script and running any
+ * require()d modules, which is far more expensive than most queries. Idle
+ * states are kept here keyed by table options and script mtime, and handed
+ * back out after their globals are restored to the post-load snapshot.
+ */
+
+#include <sys/stat.h>
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "funcapi.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#include "lua_fdw.h"
+
+/* registry key holding a shallow copy of _G taken just after loading */
+#define LUA_FDW_SNAPSHOT "lua_fdw.snapshot"
+
+typedef struct
+{
+	char *script;
+	char *inject;
+	char *lua_path;
+	char *lua_cpath;
+	time_t mtime;
+	lua_State *lua;
+	bool in_use;
+	SubTransactionId subxid;
+	uint64 last_used;
+} LuaFdwPoolEntry;
+
+int lua_fdw_pool_size = 4;
+
+static LuaFdwPoolEntry *pool = NULL;
+static int pool_length = 0;
+static int pool_capacity = 0;
+static uint64 pool_clock = 0;
+
+static uint64 pool_hits = 0;
+static uint64 pool_misses = 0;
+static uint64 pool_evictions = 0;
+
+extern Datum lua_fdw_pool_stats(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(lua_fdw_pool_stats);
+
+static bool
+option_equal (const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return strcmp(a, b) == 0;
+}
+
+static char*
+option_copy (const char *s)
+{
+	return s ? MemoryContextStrdup(TopMemoryContext, s) : NULL;
+}
+
+static time_t
+script_mtime (const char *script)
+{
+	struct stat st;
+
+	if (script && stat(script, &st) == 0)
+		return st.st_mtime;
+
+	return 0;
+}
+
+static void
+lua_snapshot (lua_State *lua)
+{
+	lua_createtable(lua, 0, 0);
+	lua_pushglobaltable(lua);
+	lua_pushnil(lua);
+
+	while (lua_next(lua, -2))
+	{
+		lua_pushvalue(lua, -2);
+		lua_insert(lua, -2);
+		lua_rawset(lua, -5);
+	}
+	lua_pop(lua, 1); // _G
+
+	lua_setfield(lua, LUA_REGISTRYINDEX, LUA_FDW_SNAPSHOT);
+}
+
+/*
+ * Put _G back the way it was when the script finished loading. This is a
+ * shallow restore: globals assigned since then are reverted, new globals
+ * are removed, but tables mutated in place keep their contents.
+ */
+static void
+lua_restore (lua_State *lua)
+{
+	lua_settop(lua, 0);
+
+	lua_getfield(lua, LUA_REGISTRYINDEX, LUA_FDW_SNAPSHOT);
+	lua_pushglobaltable(lua);
+	lua_pushnil(lua);
+
+	while (lua_next(lua, 2))
+	{
+		lua_pop(lua, 1);
+		lua_pushvalue(lua, -1);
+		lua_rawget(lua, 1);
+
+		if (lua_isnil(lua, -1))
+		{
+			/* clearing an existing field is allowed during lua_next */
+			lua_pushvalue(lua, -2);
+			lua_pushnil(lua);
+			lua_rawset(lua, 2);
+		}
+		lua_pop(lua, 1);
+	}
+
+	lua_pushnil(lua);
+
+	while (lua_next(lua, 1))
+	{
+		lua_pushvalue(lua, -2);
+		lua_insert(lua, -2);
+		lua_rawset(lua, 2);
+	}
+
+	lua_settop(lua, 0);
+	lua_globals(lua);
+}
+
+static void
+pool_remove (int i)
+{
+	LuaFdwPoolEntry *entry = &pool[i];
+
+	if (entry->script) pfree(entry->script);
+	if (entry->inject) pfree(entry->inject);
+	if (entry->lua_path) pfree(entry->lua_path);
+	if (entry->lua_cpath) pfree(entry->lua_cpath);
+
+	pool[i] = pool[--pool_length];
+}
+
+static void
+pool_close (int i)
+{
+	lua_State *lua = pool[i].lua;
+
+	pool_remove(i);
+	lua_stop(lua);
+}
+
+static int
+pool_find (lua_State *lua)
+{
+	int i;
+
+	for (i = 0; i < pool_length; i++)
+	{
+		if (pool[i].lua == lua)
+			return i;
+	}
+	return -1;
+}
+
+static void
+pool_idle (int i)
+{
+	pool[i].in_use = false;
+	pool[i].last_used = ++pool_clock;
+
+	lua_settop(pool[i].lua, 0);
+	lua_gc(pool[i].lua, LUA_GCCOLLECT, 0);
+}
+
+/*
+ * Close least recently used idle states until no more than
+ * lua_fdw.pool_size remain.
+ */
+static void
+pool_trim (void)
+{
+	int i, idle, victim;
+
+	for (;;)
+	{
+		idle = 0;
+		victim = -1;
+
+		for (i = 0; i < pool_length; i++)
+		{
+			if (pool[i].in_use)
+				continue;
+
+			idle++;
+
+			if (victim < 0 || pool[i].last_used < pool[victim].last_used)
+				victim = i;
+		}
+
+		if (idle <= lua_fdw_pool_size)
+			break;
+
+		pool_close(victim);
+		pool_evictions++;
+	}
+}
+
+static void
+pool_xact_callback (XactEvent event, void *arg)
+{
+	int i;
+
+	switch (event)
+	{
+		case XACT_EVENT_ABORT:
+#if PG_VERSION_NUM >= 90500
+		case XACT_EVENT_PARALLEL_ABORT:
+#endif
+			/*
+			 * States still in use were interrupted mid-scan, possibly inside
+			 * a Lua callback. Their globals and open resources can't be
+			 * trusted, so throw them away.
+			 */
+			for (i = pool_length - 1; i >= 0; i--)
+			{
+				if (pool[i].in_use)
+					pool_close(i);
+			}
+			break;
+
+		case XACT_EVENT_COMMIT:
+#if PG_VERSION_NUM >= 90500
+		case XACT_EVENT_PARALLEL_COMMIT:
+#endif
+			/* planned but never executed, eg pruned subplans */
+			for (i = 0; i < pool_length; i++)
+			{
+				if (pool[i].in_use)
+					pool_idle(i);
+			}
+			pool_trim();
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void
+pool_subxact_callback (SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg)
+{
+	int i;
+
+	for (i = pool_length - 1; i >= 0; i--)
+	{
+		if (!pool[i].in_use || pool[i].subxid != mySubid)
+			continue;
+
+		if (event == SUBXACT_EVENT_ABORT_SUB)
+			pool_close(i);
+		else
+		if (event == SUBXACT_EVENT_COMMIT_SUB)
+			pool[i].subxid = parentSubid;
+	}
+}
+
+void
+lua_pool_init (void)
+{
+	DefineCustomIntVariable(
+		"lua_fdw.pool_size",
+		"Number of idle Lua states each backend keeps for reuse.",
+		"Set to zero to start a fresh Lua state for every query.",
+		&lua_fdw_pool_size,
+		4,
+		0,
+		1024,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	RegisterXactCallback(pool_xact_callback, NULL);
+	RegisterSubXactCallback(pool_subxact_callback, NULL);
+}
+
+/*
+ * Hand out an idle state started with the same options, or start a new one.
+ */
+lua_State*
+lua_acquire (const char *script, const char *inject, const char *lua_path, const char *lua_cpath)
+{
+	LuaFdwPoolEntry *entry;
+	lua_State *lua;
+	time_t mtime;
+	int i;
+
+	mtime = script_mtime(script);
+
+	for (i = pool_length - 1; i >= 0; i--)
+	{
+		entry = &pool[i];
+
+		if (entry->in_use
+			|| !option_equal(entry->script, script)
+			|| !option_equal(entry->inject, inject)
+			|| !option_equal(entry->lua_path, lua_path)
+			|| !option_equal(entry->lua_cpath, lua_cpath))
+			continue;
+
+		if (entry->mtime != mtime)
+		{
+			/* script changed on disk */
+			pool_close(i);
+			pool_evictions++;
+			continue;
+		}
+
+		entry->in_use = true;
+		entry->subxid = GetCurrentSubTransactionId();
+		pool_hits++;
+
+		lua_restore(entry->lua);
+		return entry->lua;
+	}
+
+	pool_misses++;
+
+	lua = lua_start(script, inject, lua_path, lua_cpath);
+	lua_snapshot(lua);
+
+	if (pool_length == pool_capacity)
+	{
+		pool_capacity = pool_capacity ? pool_capacity * 2 : 8;
+		pool = pool
+			? repalloc(pool, sizeof(LuaFdwPoolEntry) * pool_capacity)
+			: MemoryContextAlloc(TopMemoryContext, sizeof(LuaFdwPoolEntry) * pool_capacity);
+	}
+
+	entry = &pool[pool_length++];
+	entry->script = option_copy(script);
+	entry->inject = option_copy(inject);
+	entry->lua_path = option_copy(lua_path);
+	entry->lua_cpath = option_copy(lua_cpath);
+	entry->mtime = mtime;
+	entry->lua = lua;
+	entry->in_use = true;
+	entry->subxid = GetCurrentSubTransactionId();
+	entry->last_used = 0;
+
+	return lua;
+}
+
+/*
+ * Return a state to the pool once a scan is done with it.
+ */
+void
+lua_release (lua_State *lua)
+{
+	int i = pool_find(lua);
+
+	if (i < 0)
+	{
+		lua_stop(lua);
+		return;
+	}
+
+	if (lua_panicked(lua))
+	{
+		pool_close(i);
+		return;
+	}
+
+	pool_idle(i);
+	pool_trim();
+}
+
+/*
+ * Close a state that must not be reused.
+ */
+void
+lua_discard (lua_State *lua)
+{
+	int i = pool_find(lua);
+
+	if (i < 0)
+		lua_stop(lua);
+	else
+		pool_close(i);
+}
+
+Datum
+lua_fdw_pool_stats (PG_FUNCTION_ARGS)
+{
+	TupleDesc desc;
+	Datum values[5];
+	bool nulls[5];
+	int i, idle = 0, in_use = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &desc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	for (i = 0; i < pool_length; i++)
+	{
+		if (pool[i].in_use)
+			in_use++;
+		else
+			idle++;
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int32GetDatum(idle);
+	values[1] = Int32GetDatum(in_use);
+	values[2] = Int64GetDatum(pool_hits);
+	values[3] = Int64GetDatum(pool_misses);
+	values[4] = Int64GetDatum(pool_evictions);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(desc), values, nulls)));
+}
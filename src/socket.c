@@ -0,0 +1,211 @@
+/*-------------------------------------------------------------------------
+ *
+ * Lua Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2016 Sean Pringle (lua_fdw)
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Andrew Dunstan <andrew@dunslane.net> (blackhole_fdw)
+ * Author: Sean Pringle <sean.pringle@gmail.com> (lua_fdw)
+ *
+ *-------------------------------------------------------------------------
+ *
+ * Connected local socket pairs for scripts, as fdw.socketpair().
+ *
+ * An async_capable ScanIterate yields a socket to wait on. Scripts talking
+ * to a network service get one from their socket library; a pair lets a
+ * script wake its own coroutine, or try asynchronous scans without one.
+ * Methods follow LuaSocket's names, with non-blocking semantics: receive
+ * returns nil, "timeout" when nothing is buffered.
+ */
+
+#include "postgres.h"
+
+#include <sys/socket.h>
+
+#include "lua_fdw.h"
+
+#define SOCKET_METATABLE "lua_fdw.socket"
+#define SOCKET_RECEIVE_SIZE 8192
+
+typedef struct
+{
+	pgsocket fd;
+} LuaFdwSocket;
+
+static LuaFdwSocket*
+socket_check (lua_State *lua)
+{
+	LuaFdwSocket *sock = (LuaFdwSocket *) luaL_checkudata(lua, 1, SOCKET_METATABLE);
+
+	if (sock->fd == PGINVALID_SOCKET)
+		luaL_error(lua, "attempt to use a closed socket");
+
+	return sock;
+}
+
+/*
+ * Push nil and a LuaSocket style message for a failed call.
+ */
+static int
+socket_failure (lua_State *lua, int err)
+{
+	lua_pushnil(lua);
+
+	if (err == EAGAIN || err == EWOULDBLOCK)
+		lua_pushstring(lua, "timeout");
+	else
+	if (err == EPIPE || err == ECONNRESET)
+		lua_pushstring(lua, "closed");
+	else
+		lua_pushstring(lua, strerror(err));
+
+	return 2;
+}
+
+/*
+ * sock:getfd(), the descriptor to yield from ScanIterate.
+ */
+static int
+socket_getfd (lua_State *lua)
+{
+	lua_pushinteger(lua, socket_check(lua)->fd);
+	return 1;
+}
+
+/*
+ * sock:send(data): bytes sent, or nil and a message.
+ */
+static int
+socket_send (lua_State *lua)
+{
+	LuaFdwSocket *sock = socket_check(lua);
+	size_t len;
+	const char *data = luaL_checklstring(lua, 2, &len);
+	ssize_t n;
+
+	n = send(sock->fd, data, len, 0);
+
+	if (n < 0)
+		return socket_failure(lua, errno);
+
+	lua_pushinteger(lua, n);
+	return 1;
+}
+
+/*
+ * sock:receive([n]): up to n bytes already buffered, nil, "timeout" if there
+ * are none yet, or nil, "closed" once the other end has closed.
+ */
+static int
+socket_receive (lua_State *lua)
+{
+	LuaFdwSocket *sock = socket_check(lua);
+	char buf[SOCKET_RECEIVE_SIZE];
+	int size = (int) luaL_optinteger(lua, 2, SOCKET_RECEIVE_SIZE);
+	ssize_t n;
+
+	if (size < 1 || size > SOCKET_RECEIVE_SIZE)
+		size = SOCKET_RECEIVE_SIZE;
+
+	n = recv(sock->fd, buf, size, 0);
+
+	if (n < 0)
+		return socket_failure(lua, errno);
+
+	if (n == 0)
+		return socket_failure(lua, EPIPE);
+
+	lua_pushlstring(lua, buf, n);
+	return 1;
+}
+
+static int
+socket_close (lua_State *lua)
+{
+	LuaFdwSocket *sock = (LuaFdwSocket *) luaL_checkudata(lua, 1, SOCKET_METATABLE);
+
+	if (sock->fd != PGINVALID_SOCKET)
+	{
+		closesocket(sock->fd);
+		sock->fd = PGINVALID_SOCKET;
+	}
+
+	return 0;
+}
+
+static LuaFdwSocket*
+socket_new (lua_State *lua)
+{
+	LuaFdwSocket *sock = (LuaFdwSocket *) lua_newuserdata(lua, sizeof(LuaFdwSocket));
+
+	sock->fd = PGINVALID_SOCKET;
+	luaL_getmetatable(lua, SOCKET_METATABLE);
+	lua_setmetatable(lua, -2);
+
+	return sock;
+}
+
+/*
+ * fdw.socketpair(): two connected, non-blocking sockets, or nil and a
+ * message. Each is closed by close() or when collected.
+ */
+static int
+socket_pair (lua_State *lua)
+{
+	LuaFdwSocket *a = socket_new(lua);
+	LuaFdwSocket *b = socket_new(lua);
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return socket_failure(lua, errno);
+
+	a->fd = fds[0];
+	b->fd = fds[1];
+
+	if (!pg_set_noblock(a->fd) || !pg_set_noblock(b->fd))
+		return socket_failure(lua, errno);
+
+	return 2;
+}
+
+static const luaL_Reg socket_methods[] = {
+	{"getfd", socket_getfd},
+	{"send", socket_send},
+	{"receive", socket_receive},
+	{"close", socket_close},
+	{NULL, NULL}
+};
+
+/*
+ * Push the fdw.socketpair function.
+ */
+void
+lua_socket_push (lua_State *lua)
+{
+	const luaL_Reg *reg;
+
+	if (luaL_newmetatable(lua, SOCKET_METATABLE))
+	{
+		lua_createtable(lua, 0, 0);
+
+		for (reg = socket_methods; reg->name; reg++)
+		{
+			lua_pushcfunction(lua, reg->func);
+			lua_setfield(lua, -2, reg->name);
+		}
+		lua_setfield(lua, -2, "__index");
+
+		lua_pushcfunction(lua, socket_close);
+		lua_setfield(lua, -2, "__gc");
+
+#if LUA_VERSION_NUM >= 504
+		lua_pushcfunction(lua, socket_close);
+		lua_setfield(lua, -2, "__close");
+#endif
+	}
+	lua_pop(lua, 1);
+
+	lua_pushcfunction(lua, socket_pair);
+}
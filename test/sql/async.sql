@@ -0,0 +1,24 @@
+CREATE SERVER async_srv FOREIGN DATA WRAPPER lua_fdw;
+
+-- async_capable scans run ScanIterate as a coroutine under Append (PostgreSQL 14+)
+CREATE FOREIGN TABLE async_a (id integer) SERVER async_srv
+  OPTIONS (inject 'function ScanStart () n = 0 end function ScanIterate () n = n + 1 if n <= 2 then return { id = n } end end', async_capable 'true');
+CREATE FOREIGN TABLE async_b (id integer) SERVER async_srv
+  OPTIONS (inject 'function ScanStart () n = 0 end function ScanIterate () n = n + 1 if n <= 2 then return { id = n + 10 } end end', async_capable 'true');
+EXPLAIN (COSTS OFF) SELECT * FROM async_a UNION ALL SELECT * FROM async_b;
+SELECT * FROM async_a UNION ALL SELECT * FROM async_b ORDER BY id;
+
+-- ScanIterate yields a socket and Append resumes whichever scan is ready,
+-- so rows from the two scans interleave; elsewhere each scan waits in turn
+CREATE FOREIGN TABLE wait_a (id integer) SERVER async_srv
+  OPTIONS (inject 'function ScanStart () n = 0 wake, wait = fdw.socketpair() end function ScanIterate () n = n + 1 if n > 2 then return nil end wake:send("x") coroutine.yield(wait:getfd()) wait:receive() return { id = n } end', async_capable 'true');
+CREATE FOREIGN TABLE wait_b (id integer) SERVER async_srv
+  OPTIONS (inject 'function ScanStart () n = 0 wake, wait = fdw.socketpair() end function ScanIterate () n = n + 1 if n > 2 then return nil end wake:send("x") coroutine.yield(wait:getfd()) wait:receive() return { id = n + 10 } end', async_capable 'true');
+SELECT * FROM wait_a UNION ALL SELECT * FROM wait_b;
+
+-- Append only waits for readable sockets, a wait to write happens in place
+CREATE FOREIGN TABLE write_a (id integer) SERVER async_srv
+  OPTIONS (inject 'function ScanStart () n = 0 wake = fdw.socketpair() end function ScanIterate () n = n + 1 if n > 2 then return nil end coroutine.yield(wake:getfd(), "write") return { id = n } end', async_capable 'true');
+CREATE FOREIGN TABLE write_b (id integer) SERVER async_srv
+  OPTIONS (inject 'function ScanStart () n = 0 wake = fdw.socketpair() end function ScanIterate () n = n + 1 if n > 2 then return nil end coroutine.yield(wake:getfd(), "write") return { id = n + 10 } end', async_capable 'true');
+SELECT count(*) FROM (SELECT * FROM write_a UNION ALL SELECT * FROM write_b) s;
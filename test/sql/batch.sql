@@ -0,0 +1,7 @@
+CREATE SERVER batch_srv FOREIGN DATA WRAPPER lua_fdw;
+
+-- INSERT passes arrays of batch_size rows to InsertBatch (PostgreSQL 14+),
+-- earlier servers call it once per row
+CREATE FOREIGN TABLE batch_sink (id integer, name text) SERVER batch_srv
+  OPTIONS (inject 'function InsertBatch (rows) fdw.ereport(fdw.NOTICE, "InsertBatch " .. #rows .. " rows from " .. rows[1].id) end', batch_size '2');
+INSERT INTO batch_sink SELECT g, 'row ' || g FROM generate_series(1, 5) g;
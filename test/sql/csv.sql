@@ -0,0 +1,82 @@
+CREATE SERVER csv_srv FOREIGN DATA WRAPPER lua_fdw;
+
+-- fdw.csv.open: CRLF line endings, blank lines, doubled quotes and quoted
+-- delimiters; an empty unquoted field is NULL, a quoted one an empty string
+CREATE FOREIGN TABLE csv_crlf (id integer, name text) SERVER csv_srv OPTIONS (inject $$
+  function ScanStart ()
+    path = os.tmpname()
+    local f = assert(io.open(path, "wb"))
+    f:write('id,name\r\n1,one\r\n2,"two ""quoted"", with comma"\r\n3,\r\n\r\n4,""\r\n')
+    f:close()
+    reader = assert(fdw.csv.open(path))
+  end
+  function ScanIterate () return reader:read() end
+  function ScanEnd () reader:close() os.remove(path) end
+$$);
+SELECT id, name, name IS NULL AS is_null FROM csv_crlf;
+
+-- null = false reads every field as a string
+CREATE FOREIGN TABLE csv_nonull (id integer, name text) SERVER csv_srv OPTIONS (inject $$
+  function ScanStart ()
+    path = os.tmpname()
+    local f = assert(io.open(path, "wb"))
+    f:write('id,name\n1,\n2,""\n')
+    f:close()
+    reader = assert(fdw.csv.open(path, { null = false }))
+  end
+  function ScanIterate () return reader:read() end
+  function ScanEnd () reader:close() os.remove(path) end
+$$);
+SELECT id, name IS NULL AS is_null FROM csv_nonull;
+
+-- a quoted newline just before the first 64kB block ends, with the rest of
+-- the field read by the next refill
+CREATE FOREIGN TABLE csv_span (id integer, note text) SERVER csv_srv OPTIONS (inject $$
+  function ScanStart ()
+    path = os.tmpname()
+    local f = assert(io.open(path, "wb"))
+    f:write('id,note\n1,"' .. string.rep("x", 65522) .. '\nend"\n2,after\n')
+    f:close()
+    reader = assert(fdw.csv.open(path))
+  end
+  function ScanIterate () return reader:read() end
+  function ScanEnd () reader:close() os.remove(path) end
+$$);
+SELECT id, length(note), replace(right(note, 5), E'\n', '|') AS tail FROM csv_span;
+
+-- a record longer than the buffer grows it
+CREATE FOREIGN TABLE csv_long (id integer, note text) SERVER csv_srv OPTIONS (inject $$
+  function ScanStart ()
+    path = os.tmpname()
+    local f = assert(io.open(path, "wb"))
+    f:write('id,note\n1,' .. string.rep("y", 200000) .. '\n2,short\n')
+    f:close()
+    reader = assert(fdw.csv.open(path))
+  end
+  function ScanIterate () return reader:read() end
+  function ScanEnd () reader:close() os.remove(path) end
+$$);
+SELECT id, length(note) FROM csv_long;
+
+-- rewind starts again after the header line
+CREATE FOREIGN TABLE csv_rewind (id integer) SERVER csv_srv OPTIONS (inject $$
+  function ScanStart ()
+    path = os.tmpname()
+    local f = assert(io.open(path, "wb"))
+    f:write('id\n1\n2\n')
+    f:close()
+    reader = assert(fdw.csv.open(path))
+    rewound = false
+  end
+  function ScanIterate ()
+    local row = reader:read()
+    if row == nil and not rewound then
+      rewound = true
+      reader:rewind()
+      row = reader:read()
+    end
+    return row
+  end
+  function ScanEnd () reader:close() os.remove(path) end
+$$);
+SELECT * FROM csv_rewind;
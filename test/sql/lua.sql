@@ -0,0 +1,22 @@
+CREATE SERVER lua_srv FOREIGN DATA WRAPPER lua_fdw;
+
+-- COPY FROM and tuple routing collect copy_batch_size rows in C per InsertBatch
+CREATE FOREIGN TABLE copy_sink (id integer, name text) SERVER lua_srv
+  OPTIONS (inject 'function InsertBatch (rows) fdw.ereport(fdw.NOTICE, "InsertBatch " .. #rows .. " rows from " .. rows[1].id) end', copy_batch_size '3');
+COPY copy_sink FROM stdin WITH (FORMAT csv);
+1,one
+2,two
+3,three
+4,four
+5,five
+\.
+CREATE TABLE routed (id integer, name text) PARTITION BY RANGE (id);
+CREATE FOREIGN TABLE routed_lua PARTITION OF routed FOR VALUES FROM (1) TO (100) SERVER lua_srv
+  OPTIONS (inject 'function InsertBatch (rows) fdw.ereport(fdw.NOTICE, "InsertBatch " .. #rows .. " rows from " .. rows[1].id) end', copy_batch_size '3');
+INSERT INTO routed SELECT g, 'row ' || g FROM generate_series(1, 5) g;
+
+-- ANALYZE scans with empty fdw.clauses and fdw.quals
+CREATE FOREIGN TABLE analyzed (id integer) SERVER lua_srv
+  OPTIONS (inject 'function ScanStart () n = #fdw.clauses + #fdw.quals end function ScanIterate () n = n + 1 if n <= 3 then return { id = n } end end');
+ANALYZE analyzed;
+SELECT reltuples FROM pg_class WHERE relname = 'analyzed';
@@ -0,0 +1,17 @@
+CREATE SERVER prefetch_srv FOREIGN DATA WRAPPER lua_fdw;
+
+-- prefetch runs the script in a background worker, rows arrive through a queue
+CREATE FOREIGN TABLE prefetched (id integer, name text) SERVER prefetch_srv
+  OPTIONS (inject 'function ScanStart () n = 0 end function ScanIterate () n = n + 1 if n <= 5 then return { id = n, name = "row " .. n } end end', prefetch 'true');
+SELECT * FROM prefetched;
+SELECT count(*), sum(id) FROM prefetched;
+
+-- a LIMIT ends the scan early and stops the worker
+CREATE FOREIGN TABLE endless (id integer) SERVER prefetch_srv
+  OPTIONS (inject 'function ScanStart () n = 0 end function ScanIterate () n = n + 1 return { id = n } end', prefetch 'true');
+SELECT * FROM endless LIMIT 3;
+
+-- errors in the worker are raised by the query
+CREATE FOREIGN TABLE failing (id integer) SERVER prefetch_srv
+  OPTIONS (inject 'function ScanStart () n = 0 end function ScanIterate () n = n + 1 if n > 2 then fdw.ereport(fdw.ERROR, "failed at row " .. n) end return { id = n } end', prefetch 'true');
+SELECT * FROM failing;
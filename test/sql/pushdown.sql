@@ -0,0 +1,142 @@
+CREATE SERVER pushdown_srv FOREIGN DATA WRAPPER lua_fdw;
+
+-- clauses PlanClauses marks exact leave the Filter, and allow fdw.limit
+CREATE FOREIGN TABLE exact_t (id integer, name text) SERVER pushdown_srv OPTIONS (inject $$
+  function PlanClauses (clauses)
+    local marks = {}
+    for i, clause in ipairs(clauses) do
+      marks[i] = clause.column == "id" and "exact" or "unsupported"
+    end
+    return marks
+  end
+  function ScanStart ()
+    n = 0
+    for _, clause in ipairs(fdw.clauses) do
+      if clause.column == "id" and clause.operator == "gt" then n = clause.constant end
+    end
+  end
+  function ScanIterate () n = n + 1 if n <= 5 then return { id = n, name = "row " .. n } end end
+  function ScanExplain () return "limit " .. tostring(fdw.limit) end
+$$);
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM exact_t WHERE id > 2 AND name <> 'row 4';
+SELECT * FROM exact_t WHERE id > 2 AND name <> 'row 4';
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM exact_t WHERE id > 2 LIMIT 2;
+SELECT * FROM exact_t WHERE id > 2 LIMIT 2;
+
+-- an inner join of two tables with the same options runs as one scan
+CREATE FOREIGN TABLE users (id integer, name text) SERVER pushdown_srv OPTIONS (inject $$
+  data = {
+    users = { { id = 1, name = "ann" }, { id = 2, name = "bob" } },
+    orders = { { user_id = 1, total = 10 }, { user_id = 1, total = 20 }, { user_id = 2, total = 5 } },
+  }
+  function PlanJoin (outer, inner, jointype, clauses) return #clauses > 0, nil, 0, 1 end
+  function ScanStart ()
+    n = 0
+    rows = data[fdw.table]
+    if fdw.join then
+      local o, i = fdw.join.outer, fdw.join.inner
+      rows = {}
+      for _, a in ipairs(data[o.table]) do
+        for _, b in ipairs(data[i.table]) do
+          local match = true
+          for _, clause in ipairs(fdw.join.clauses) do
+            if a[clause.outer] ~= b[clause.inner] then match = false end
+          end
+          if match then
+            local row = {}
+            for k, v in pairs(a) do row[o.alias .. "." .. k] = v end
+            for k, v in pairs(b) do row[i.alias .. "." .. k] = v end
+            rows[#rows + 1] = row
+          end
+        end
+      end
+    end
+  end
+  function ScanIterate () n = n + 1 return rows[n] end
+$$);
+CREATE FOREIGN TABLE orders (user_id integer, total integer) SERVER pushdown_srv OPTIONS (inject $$
+  data = {
+    users = { { id = 1, name = "ann" }, { id = 2, name = "bob" } },
+    orders = { { user_id = 1, total = 10 }, { user_id = 1, total = 20 }, { user_id = 2, total = 5 } },
+  }
+  function PlanJoin (outer, inner, jointype, clauses) return #clauses > 0, nil, 0, 1 end
+  function ScanStart ()
+    n = 0
+    rows = data[fdw.table]
+    if fdw.join then
+      local o, i = fdw.join.outer, fdw.join.inner
+      rows = {}
+      for _, a in ipairs(data[o.table]) do
+        for _, b in ipairs(data[i.table]) do
+          local match = true
+          for _, clause in ipairs(fdw.join.clauses) do
+            if a[clause.outer] ~= b[clause.inner] then match = false end
+          end
+          if match then
+            local row = {}
+            for k, v in pairs(a) do row[o.alias .. "." .. k] = v end
+            for k, v in pairs(b) do row[i.alias .. "." .. k] = v end
+            rows[#rows + 1] = row
+          end
+        end
+      end
+    end
+  end
+  function ScanIterate () n = n + 1 return rows[n] end
+$$);
+EXPLAIN (COSTS OFF) SELECT u.name, o.total FROM users u JOIN orders o ON o.user_id = u.id ORDER BY o.total;
+SELECT u.name, o.total FROM users u JOIN orders o ON o.user_id = u.id ORDER BY o.total;
+
+-- GROUP BY and aggregates run in the script
+CREATE FOREIGN TABLE sales (region text, amount integer) SERVER pushdown_srv OPTIONS (inject $$
+  data = { { region = "east", amount = 10 }, { region = "west", amount = 5 }, { region = "east", amount = 7 } }
+  function PlanAggregate (groups, aggs, clauses) return #clauses == 0, nil, 0, 1 end
+  function ScanStart ()
+    n = 0
+    rows = data
+    if fdw.aggregate then
+      local groups = {}
+      rows = {}
+      for _, r in ipairs(data) do
+        local out = groups[r.region]
+        if not out then
+          out = { region = r.region }
+          groups[r.region] = out
+          rows[#rows + 1] = out
+        end
+        for _, agg in ipairs(fdw.aggregate.aggs) do
+          local v = r[agg.column]
+          if agg.func == "count" then out[agg.name] = (out[agg.name] or 0) + 1
+          elseif agg.func == "sum" then out[agg.name] = (out[agg.name] or 0) + v
+          elseif agg.func == "max" then out[agg.name] = math.max(out[agg.name] or v, v) end
+        end
+      end
+    end
+  end
+  function ScanIterate () n = n + 1 return rows[n] end
+$$);
+EXPLAIN (COSTS OFF) SELECT region, count(*), sum(amount), max(amount) FROM sales GROUP BY region ORDER BY region;
+SELECT region, count(*), sum(amount), max(amount) FROM sales GROUP BY region ORDER BY region;
+
+-- a sorted scan replaces the Sort, and then takes the LIMIT too
+CREATE FOREIGN TABLE events (ts integer) SERVER pushdown_srv OPTIONS (inject $$
+  function EstimateSortedPaths (order_by)
+    if #order_by == 1 and order_by[1].column == "ts" then return 0, 1 end
+  end
+  function ScanStart ()
+    n = 0
+    rows = { 10, 30, 20 }
+    if fdw.order_by then
+      local desc = fdw.order_by[1].direction == "desc"
+      table.sort(rows, function (a, b) if desc then return a > b end return a < b end)
+    end
+  end
+  function ScanIterate () n = n + 1 if rows[n] then return { ts = rows[n] } end end
+  function ScanExplain ()
+    local o = fdw.order_by and fdw.order_by[1]
+    return (o and o.column .. " " .. o.direction .. " nulls " .. o.nulls or "unordered") .. ", limit " .. tostring(fdw.limit)
+  end
+$$);
+EXPLAIN (COSTS OFF) SELECT ts FROM events ORDER BY ts DESC LIMIT 2;
+SELECT ts FROM events ORDER BY ts DESC LIMIT 2;
+SELECT ts FROM events ORDER BY ts;